@@ -29,9 +29,19 @@
 
 
 buf_t *buf_new(size_t default_size)
+{
+	return buf_new_headroom(default_size, 0);
+}
+
+/* Headroom is kept free in front of the data, so headers can be
+ * prepended with buf_reserve_begin without moving the payload */
+buf_t *buf_new_headroom(size_t default_size, size_t headroom)
 {
 	buf_t *p;
 
+	if (headroom > default_size)
+		headroom = default_size;
+
 	p = malloc(sizeof(buf_t));
 	if (!p)
 		return NULL;
@@ -40,14 +50,28 @@ buf_t *buf_new(size_t default_size)
 		free(p);
 		return NULL;
 	}
-	p->data = p->buffer;
-	p->head_avail = 0;
-	p->data_avail = default_size;
+	p->data = p->buffer + headroom;
+	p->head_avail = headroom;
+	p->data_avail = default_size - headroom;
 	p->tail_avail = 0;
 	p->data_size = 0;
+	p->headroom = headroom;
 	return p;
 }
 
+/* Set up a buffer over size bytes of memory owned by the caller. It can
+ * not grow and must not be passed to buf_free. */
+void buf_init(buf_t *p, uint8_t *buffer, size_t size)
+{
+	p->buffer = buffer;
+	p->data = buffer;
+	p->head_avail = 0;
+	p->data_avail = size;
+	p->tail_avail = 0;
+	p->data_size = 0;
+	p->headroom = 0;
+}
+
 size_t buf_total_size(buf_t *p)
 {
 	if (!p)
@@ -118,16 +142,34 @@ void buf_resize(buf_t *p, size_t new_size)
 
 buf_t *buf_reuse(buf_t *p)
 {
+	size_t size;
+
 	if (!p)
 		return NULL;
-	p->data_avail = buf_total_size(p);
-	p->head_avail = 0;
+	size = buf_total_size(p);
+	p->head_avail = p->headroom < size ? p->headroom : size;
+	p->data_avail = size - p->head_avail;
 	p->tail_avail = 0;
 	p->data_size = 0;
-	p->data = p->buffer;
+	p->data = p->buffer + p->head_avail;
 	return p;
 }
 
+/* Move the data back to the front of the buffer, so the space of data
+ * removed with buf_remove_begin can be reserved at the end again */
+void buf_compact(buf_t *p)
+{
+	size_t head;
+
+	if (!p || p->head_avail <= p->headroom)
+		return;
+	head = p->headroom;
+	memmove(p->buffer + head, p->data, p->data_size);
+	p->data_avail += p->head_avail - head;
+	p->head_avail = head;
+	p->data = p->buffer + head;
+}
+
 void *buf_reserve_begin(buf_t *p, size_t data_size)
 {
 	if (!p)
@@ -229,6 +271,27 @@ void buf_remove_end(buf_t *p, size_t data_size)
 	}
 }
 
+/* Take ownership of the allocated space. The data is moved to the start
+ * of the returned block, which must be released with free(). The buf_t
+ * itself is left empty and still has to be freed with buf_free. */
+uint8_t *buf_detach(buf_t *p)
+{
+	uint8_t *data;
+
+	if (!p || !p->buffer)
+		return NULL;
+	if (p->data != p->buffer)
+		memmove(p->buffer, p->data, p->data_size);
+	data = p->buffer;
+	p->buffer = NULL;
+	p->data = NULL;
+	p->head_avail = 0;
+	p->data_avail = 0;
+	p->tail_avail = 0;
+	p->data_size = 0;
+	return data;
+}
+
 void buf_dump(buf_t *p, const char *label)
 {
 	int i, n;
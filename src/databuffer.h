@@ -34,18 +34,23 @@ typedef struct {
 	size_t data_avail; // allocated space available not specific for head or tail
 	size_t tail_avail; // number of allocated space available at end of buffer
 	size_t data_size; // number of allocated space used
+	size_t headroom; // space buf_reuse keeps available in front of buffer
 } buf_t;
 
 buf_t *buf_new(size_t default_size);
+buf_t *buf_new_headroom(size_t default_size, size_t headroom);
+void buf_init(buf_t *p, uint8_t *buffer, size_t size);
 size_t buf_total_size(buf_t *p);
 void buf_resize(buf_t *p, size_t new_size);
 buf_t *buf_reuse(buf_t *p);
+void buf_compact(buf_t *p);
 void *buf_reserve_begin(buf_t *p, size_t data_size);
 void *buf_reserve_end(buf_t *p, size_t data_size);
 void buf_insert_begin(buf_t *p, uint8_t *data, size_t data_size);
 void buf_insert_end(buf_t *p, uint8_t *data, size_t data_size);
 void buf_remove_begin(buf_t *p, size_t data_size);
 void buf_remove_end(buf_t *p, size_t data_size);
+uint8_t *buf_detach(buf_t *p);
 void buf_dump(buf_t *p, const char *label);
 void buf_free(buf_t *p);
 
@@ -114,6 +114,25 @@ int _find(exword_t *device, char *root, char *id, admini_t *ini)
 	return 1;
 }
 
+/* Unlocks the device and sets up the key for dictionary id. The three
+ * commands are sent back to back as one batch. */
+int _unlock(exword_t *device, char *name, char *id, exword_cryptkey_t *ck)
+{
+	exword_batch_t *batch;
+	int rsp;
+	batch = exword_batch_new(device);
+	if (batch == NULL)
+		return -1;
+	if (exword_batch_unlock(batch) < 0 ||
+	    exword_batch_cname(batch, name, id) < 0 ||
+	    exword_batch_cryptkey(batch, ck) < 0)
+		rsp = -1;
+	else
+		rsp = exword_batch_run(batch);
+	exword_batch_free(batch);
+	return rsp;
+}
+
 int _crack_key(exword_t *device, char *root, char *id, char *key)
 {
 	char path[50];
@@ -138,15 +157,10 @@ int _crack_key(exword_t *device, char *root, char *id, char *key)
 
 int _upload_file(exword_t *device, char *id, char* name)
 {
-	int length, rsp;
+	int length, rsp, fd;
 	char *ext, *buffer;
 	char *filename;
 	filename = mkpath(id, name);
-	rsp = read_file(filename, &buffer, &length);
-	if (rsp != 0x20) {
-		free(filename);
-		return 0;
-	}
 	ext = strrchr(filename, '.');
 	if (ext != NULL && (strcmp(ext, ".txt") == 0 ||
 			    strcmp(ext, ".bmp") == 0 ||
@@ -154,11 +168,25 @@ int _upload_file(exword_t *device, char *id, char* name)
 			    strcmp(ext, ".TXT") == 0 ||
 			    strcmp(ext, ".BMP") == 0 ||
 			    strcmp(ext, ".HTM") == 0)) {
+		rsp = read_file(filename, &buffer, &length);
+		if (rsp != 0x20) {
+			free(filename);
+			return 0;
+		}
 		_crypt(buffer, length, key2);
+		rsp = exword_send_file(device, name, buffer, length);
+		free(buffer);
+	} else {
+		/* Files sent unencrypted are streamed from disk */
+		fd = open_file(filename, &length);
+		if (fd < 0) {
+			free(filename);
+			return 0;
+		}
+		rsp = exword_send_stream(device, name, length, read_fd, &fd);
+		close(fd);
 	}
-	rsp = exword_send_file(device, name, buffer, length);
 	free(filename);
-	free(buffer);
 	return (rsp == 0x20);
 }
 
@@ -443,9 +471,7 @@ int dict_remove(exword_t *device, char *root, char *id)
 	memcpy(ck.blk2, info.key + 2, 8);
 	memcpy(ck.blk2 + 8, info.key + 12, 4);
 	printf("Removing %s...", id);
-	rsp = exword_unlock(device);
-	rsp |= exword_cname(device, info.name, id);
-	rsp |= exword_cryptkey(device, &ck);
+	rsp = _unlock(device, info.name, id, &ck);
 	if (rsp == 0x20)
 		rsp |= exword_remove_file(device, id, 0);
 	rsp |= exword_lock(device);
@@ -495,9 +521,7 @@ int dict_install(exword_t *device, char *root, char *id)
 		printf("%s: missing diction.htm\n", id);
 		return 0;
 	}
-	rsp = exword_unlock(device);
-	rsp |= exword_cname(device, name, id);
-	rsp |= exword_cryptkey(device, &ck);
+	rsp = _unlock(device, name, id, &ck);
 	free(name);
 	if (rsp == 0x20) {
 		strcpy(path, root);
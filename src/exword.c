@@ -21,8 +21,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <strings.h>
 #include <iconv.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #include "obex.h"
 #include "exword.h"
 
@@ -55,6 +59,34 @@
  * This page details the functions used to send commands to the device.
  */
 
+/** @defgroup hotplug Hotplug
+ * This page details the functions used to get notified when devices are
+ * plugged in or removed, and to connect to them as soon as they arrive.
+ */
+
+/** @defgroup batch Batched commands
+ * This page details the functions used to send several small commands
+ * back to back. The commands of a batch reach the device in the order
+ * they were added. Each one is sent as soon as the answers to the ones
+ * before it can no longer change what has to be sent, instead of after
+ * the caller has seen the previous response. With a queue depth above
+ * one several of them may be on the bus at the same time, see
+ * \ref exword_set_queue_depth.
+ */
+
+/** @defgroup async Asynchronous commands
+ * This page details the functions used to queue commands without waiting
+ * for them to finish. Queued commands are sent one after the other and
+ * advanced by \ref exword_process_events or \ref exword_async_wait.
+ * The blocking commands are queued the same way and wait for the commands
+ * queued before them.
+ *
+ * A device handle may be shared by several threads. Their commands are
+ * sent in the order they were queued. Whichever thread is waiting handles
+ * the device events for everybody, so progress and completion callbacks
+ * may run in a thread other than the one that queued the command.
+ */
+
 static const char Model[] = {0,'_',0,'M',0,'o',0,'d',0,'e',0,'l',0,0};
 static const char List[] = {0,'_',0,'L',0,'i',0,'s',0,'t',0,0};
 static const char Remove[] = {0,'_',0,'R',0,'e',0,'m',0,'o',0,'v',0,'e',0,0};
@@ -87,9 +119,101 @@ struct exword_t {
 	char * cb_filename;
 	uint32_t cb_filelength;
 	uint32_t cb_transferred;
+
+	struct list_head async_queue;
+	pthread_mutex_t mutex;		/* Guards async_queue and the handles in it */
+	pthread_cond_t cond;		/* Signalled when a command completes */
+	int driving;			/* A thread is handling device events */
+};
+
+struct hotplug_event {
+	struct list_head link;
+	libusb_device *device;
+	int event;
+};
+
+struct hotplug_device {
+	struct list_head link;
+	libusb_device *device;
+	exword_device_t info;
+	exword_t *handle;
+};
+
+struct exword_hotplug {
+	libusb_context *usb_ctx;
+	libusb_hotplug_callback_handle cb_handle;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head events;	/* Queued by the event thread */
+	struct list_head devices;	/* Devices present */
+	hotplug_cb cb;
+	void *user_data;
+	int auto_connect;
+	uint16_t options;
+};
+
+enum {
+	ASYNC_QUEUED,
+	ASYNC_RUNNING,
+	ASYNC_DONE
+};
+
+enum {
+	ASYNC_CMD,
+	ASYNC_GET_FILE,
+	ASYNC_LIST,
+	ASYNC_SYNC		/* Blocking command, object stays with the caller */
+};
+
+#define BATCH_MAX	16
+
+enum {
+	BATCH_CMD,
+	BATCH_MODEL,
+	BATCH_CAPACITY,
+	BATCH_CRYPTKEY,
+	BATCH_LIST
+};
+
+struct batch_cmd {
+	int type;
+	void *data;		/* Where the response is parsed to */
+	uint16_t *count;	/* Number of list entries */
+	int rsp;
+};
+
+struct exword_batch {
+	exword_t *device;
+	obex_object_t *objs[BATCH_MAX];
+	struct batch_cmd cmds[BATCH_MAX];
+	int count;
+	int ran;
+};
+
+struct exword_async {
+	struct list_head link;
+	exword_t *device;
+	obex_object_t *obj;
+	obex_object_t **batch;	/* Objects sent as one request, &obj by default */
+	int batch_count;
+	int type;
+	int state;
+	int rsp;
+	async_cb cb;
+	void *user_data;
+	char *buffer;
+	int len;
+	exword_dirent_t *entries;
+	uint16_t count;
+	int in_callback;	/* Completion callback has not returned yet */
+	int freed;		/* Freed from its own callback */
+	pthread_t cb_thread;
 };
 /// @endcond
 
+static int exword_async_wait_locked(exword_async_t *h);
+static int exword_async_cancel_locked(exword_async_t *h);
+
 static char * convert (iconv_t cd,
 		char **dst, int *dstsz,
 		const char *src, int srcsz)
@@ -289,13 +413,15 @@ static void exword_handle_callbacks(obex_t *self, obex_object_t *object, void *u
 			}
 		}
 		if (exword->cb_filename) {
-			if (object->rx_body)
+			if (object->write)
+				exword->cb_transferred = object->written;
+			else if (object->rx_body)
 				exword->cb_transferred = object->rx_body->data_size;
 			if (!list_empty(&object->rx_headerq)) {
 				list_for_each(pos, &object->rx_headerq) {
 					h = list_entry(pos, struct obex_header_element, link);
 					if (h->hi == OBEX_HDR_LENGTH)
-						exword->cb_filelength = ntohl(*((uint32_t*) h->buf->data));
+						exword->cb_filelength = h->value;
 					if (h->hi == OBEX_HDR_BODY)
 						exword->cb_transferred = h->length;
 				}
@@ -314,247 +440,63 @@ static void exword_handle_callbacks(obex_t *self, obex_object_t *object, void *u
  * options of \ref OPEN_LIBRARY and \ref LOCALE_JA.
  * @returns pointer to a device handle.
  */
-exword_t * exword_open()
-{
-	return exword_open2(0x0020);
-}
-
-/** @ingroup device
- * Opens device.
- * This function will open the attached device using the specified mode
- * and region.
- * @param options bit mask of mode and region
- * @returns pointer to a device handle.
- */
-exword_t * exword_open2(uint16_t options)
-{
-	int i;
-	ssize_t ret;
-	uint8_t ver, locale;
-	struct libusb_device_descriptor desc;
-	libusb_device **dev_list = NULL;
-	libusb_device *device = NULL;
-	libusb_device_handle *dev = NULL;
-
-	locale = options & 0xff;
-	if (options & OPEN_TEXT)
-		ver = locale;
-	else if (options & OPEN_CD)
-		ver = 0xf0;
-	else
-		ver = locale - 0x0f;
-
-	exword_t *self = malloc(sizeof(exword_t));
-	if (self == NULL)
-		return NULL;
-	memset(self, 0, sizeof(exword_t));
-	ret = libusb_init(NULL);
-	if (ret < 0)
-		goto error;
-
-	ret = libusb_get_device_list(NULL, &dev_list);
-	if (ret < 0) {
-		libusb_exit(NULL);
-		goto error;
-	}
-
-	for (i = 0; i < ret; i++) {
-		device = dev_list[i];
-		if (libusb_get_device_descriptor(device, &desc) == 0) {
-			if (desc.idVendor == 0x07cf && desc.idProduct == 0x6101) {
-				if (libusb_open(device, &dev) >= 0) {
-					self->vid = desc.idVendor;
-					self->pid = desc.idProduct;
-					libusb_get_string_descriptor_ascii(dev, desc.iManufacturer, self->manufacturer, 20);
-					libusb_get_string_descriptor_ascii(dev, desc.iProduct, self->product, 20);
-					libusb_close(dev);
-					break;
-				}
-			}
-		}
-	}
-	libusb_free_device_list(dev_list, 1);
-	libusb_exit(NULL);
-
-	if (i >= ret)
-		goto error;
-
-	self->obex_ctx = obex_init(self->vid, self->pid);
-	if (self->obex_ctx == NULL)
-		goto error;
-	obex_set_connect_info(self->obex_ctx, ver, locale);
-	obex_register_callback(self->obex_ctx, exword_handle_callbacks, self);
-	return self;
-
-error:
-	free(self);
-	return NULL;
-}
-
-/** @ingroup device
- * Closes device.
- * This function closes the device and performs necessary cleanup.
- * @param self device handle
- */
-void exword_close(exword_t *self)
-{
-	if (self) {
-		obex_cleanup(self->obex_ctx);
-		free(self->cb_filename);
-		free(self);
-	}
-}
-
-/** @ingroup misc
- * Sets the debug message level.
- * This function sets the debug level for the currentlt opened device.
- * @param self device handle
- * @param level debug level (0-5)
- */
-void exword_set_debug(exword_t *self, int level)
-{
-	self->obex_ctx->debug = level;
-}
-
-/** @ingroup misc
- * Registers callback functions for sending and recieving files.
- * These functions will be invoked during file transfers after each
- * chunk of the file is transferred.\n\n
- * To remove a callback use NULL for function pointer
- * @param self device handle
- * @param get pointer to function for reporting download transfer progress
- * @param put pointer to function for reporting upload transfer progress
- * @param userdata pointer passed to callback functions
- */
-void exword_register_callbacks(exword_t *self, file_cb get, file_cb put, void *userdata)
-{
-	self->put_file_cb = put;
-	self->get_file_cb = get;
-	self->cb_userdata = userdata;
-}
-
-/** @ingroup cmd
- * Send connect command.
- * @note Any commands sent before this will fail.
- * @param self device handle
- * @return response code
- */
-int exword_connect(exword_t *self)
-{
-	int rsp;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_CONNECT);
-	if (obj == NULL)
-		return -1;
-	rsp = obex_request(self->obex_ctx, obj);
-	obex_object_delete(self->obex_ctx, obj);
-	return rsp;
-}
-
-/** @ingroup cmd
- * Upload a file to device.
- * This command will write the given file data as file filename to the device.
- * @param self device handle
- * @param filename name of file being sent.
- * @param buffer pointer to file data.
- * @param len size of buffer.
- * @return response code
- */
-int exword_send_file(exword_t *self, char* filename, char *buffer, int len)
+static obex_object_t * exword_send_file_object(exword_t *self, char* filename, char *buffer, int len)
 {
-	int length, rsp;
+	int length;
 	obex_headerdata_t hv;
 	char *unicode;
 	unicode = locale_to_utf16(&unicode, &length, filename, strlen(filename) + 1);
 	if (unicode == NULL)
-		return -1;
+		return NULL;
 	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
 	if (obj == NULL) {
 		free(unicode);
-		return -1;
+		return NULL;
 	}
 	hv.bs = unicode;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, length, 0);
 	hv.bq4 = len;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
 	hv.bs = buffer;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, len, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	obex_object_delete(self->obex_ctx, obj);
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, len, OBEX_FL_BORROW_DATA);
 	free(unicode);
-	return rsp;
+	return obj;
 }
 
-/** @ingroup cmd
- * Download a file from device.
- * This command will read a file from the device.
- * @note buffer is allocated by the function and must be freed by the user.
- * @param[in] self device handle
- * @param[in] filename name of file being sent.
- * @param[out] buffer pointer to recieved file data.
- * @param[out] len size of buffer.
- * @return response code
- */
-int exword_get_file(exword_t *self, char* filename, char **buffer, int *len)
+static obex_object_t * exword_get_file_object(exword_t *self, char* filename)
 {
-	int length, rsp;
+	int length;
 	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hv_size;
 	char *unicode;
-	*len = 0;
-	*buffer = NULL;
 	unicode = locale_to_utf16(&unicode, &length, filename, strlen(filename) + 1);
 	if (unicode == NULL)
-		return -1;
+		return NULL;
 	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
 	if (obj == NULL) {
 		free(unicode);
-		return -1;
+		return NULL;
 	}
 	hv.bs = unicode;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, length, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
-		while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
-			if (hi == OBEX_HDR_LENGTH) {
-				*len = hv.bq4;
-				*buffer = malloc(*len);
-			}
-			if (hi == OBEX_HDR_BODY) {
-				memcpy(*buffer, hv.bs, *len);
-				break;
-			}
-		}
-	}
-	obex_object_delete(self->obex_ctx, obj);
 	free(unicode);
-	return rsp;
+	return obj;
 }
 
-/** @ingroup cmd
- * Remove a file from device.
- * This command will remove the given file from the device.\n\n
- * Dataplus5 models require convert_to_unicode option when operating in Text mode.
- * @param self device handle
- * @param filename name of file being sent
- * @param convert_to_unicode automatically convert filename to UTF-16 if true
- * @return response code
- */
-int exword_remove_file(exword_t *self, char* filename, int convert_to_unicode)
+static obex_object_t * exword_remove_file_object(exword_t *self, char* filename, int convert_to_unicode)
 {
-	int rsp, length;
+	int length;
 	obex_headerdata_t hv;
 	char *unicode = NULL;
 	length = strlen(filename) + 1;
 	if (convert_to_unicode) {
 		unicode = locale_to_utf16(&unicode, &length, filename, length);
 		if (unicode == NULL)
-			return -1;
+			return NULL;
 	}
 	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
 	if (obj == NULL) {
 		free(unicode);
-		return -1;
+		return NULL;
 	}
 	hv.bs = Remove;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 16, 0);
@@ -562,60 +504,23 @@ int exword_remove_file(exword_t *self, char* filename, int convert_to_unicode)
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
 	hv.bs = convert_to_unicode ? unicode : filename;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, length, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	obex_object_delete(self->obex_ctx, obj);
 	free(unicode);
-	return rsp;
-}
-
-/** @ingroup cmd
- * Format SD card.
- * This command will format the inserted SD card.
- * @param self device handle
- * @return response code
- */
-int exword_sd_format(exword_t *self)
-{
-	int rsp, len;
-	obex_headerdata_t hv;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
-	if (obj == NULL) {
-		return -1;
-	}
-	hv.bs = SdFormat;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 20, 0);
-	hv.bq4 = 1;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
-	hv.bs = "";
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, 1, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	obex_object_delete(self->obex_ctx, obj);
-	return rsp;
+	return obj;
 }
 
-/** @ingroup cmd
- * Sets the current path on device.
- * Pathname should start with either \\_INTERNAL_00 or \\_SD_00, which will
- * access either internal memory or the sd card respectively.\n\n
- * Passing an empty string for path will allow you to get a list of storage mediums.
- * @param self device handle
- * @param path new path
- * @param mkdir if true create path if non existant
- * @return response code
- */
-int exword_setpath(exword_t *self, uint8_t *path, uint8_t mkdir)
+static obex_object_t * exword_setpath_object(exword_t *self, uint8_t *path, uint8_t mkdir)
 {
-	int len, rsp;
+	int len;
 	uint8_t non_hdr[2] = {(mkdir ? 0 : 2), 0x00};
 	obex_headerdata_t hv;
 	char *unicode;
 	unicode = locale_to_utf16(&unicode, &len, path, strlen(path) + 1);
 	if (unicode == NULL)
-		return -1;
+		return NULL;
 	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_SETPATH);
 	if (obj == NULL) {
 		free(unicode);
-		return -1;
+		return NULL;
 	}
 	if (strlen(path) == 0) {
 		len = 0;
@@ -625,58 +530,1323 @@ int exword_setpath(exword_t *self, uint8_t *path, uint8_t mkdir)
 	}
 	obex_object_set_nonhdr_data(obj, non_hdr, 2);
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, len, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	obex_object_delete(self->obex_ctx, obj);
 	free(unicode);
-	return rsp;
+	return obj;
 }
 
-/** @ingroup cmd
- * Get model information.
- * This function retrieves the model information of the connected device.
- * @param[in] self device handle
- * @param[out] model model information
- * @return response code
- */
-int exword_get_model(exword_t *self, exword_model_t * model)
+static obex_object_t * exword_list_object(exword_t *self)
+{
+	obex_headerdata_t hv;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	if (obj == NULL)
+		return NULL;
+	hv.bs = List;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 12, 0);
+	return obj;
+}
+
+static obex_object_t * exword_model_object(exword_t *self)
+{
+	obex_headerdata_t hv;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	if (obj == NULL)
+		return NULL;
+	hv.bs = Model;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 14, 0);
+	return obj;
+}
+
+static obex_object_t * exword_capacity_object(exword_t *self)
+{
+	obex_headerdata_t hv;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	if (obj == NULL)
+		return NULL;
+	hv.bs = Cap;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 10, 0);
+	return obj;
+}
+
+static obex_object_t * exword_cryptkey_object(exword_t *self, exword_cryptkey_t *key)
+{
+	obex_headerdata_t hv;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	if (obj == NULL)
+		return NULL;
+	hv.bs = CryptKey;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 20, 0);
+	hv.bs = key->blk1;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_CRYPTKEY, hv, 28, 0);
+	return obj;
+}
+
+static obex_object_t * exword_cname_object(exword_t *self, char *name, char* dir)
+{
+	obex_headerdata_t hv;
+	int dir_length, name_length;
+	char *buffer;
+	obex_object_t *obj;
+	dir_length = strlen(dir) + 1;
+	name_length = strlen(name) + 1;
+	buffer = malloc(dir_length + name_length);
+	if (buffer == NULL)
+		return NULL;
+	obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
+	if (obj == NULL) {
+		free(buffer);
+		return NULL;
+	}
+	memcpy(buffer, dir, dir_length);
+	memcpy(buffer + dir_length, name, name_length);
+	hv.bs = CName;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 14, 0);
+	hv.bq4 = dir_length + name_length;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
+	hv.bs = buffer;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, dir_length + name_length, 0);
+	free(buffer);
+	return obj;
+}
+
+static obex_object_t * exword_lock_object(exword_t *self, int lock)
+{
+	obex_headerdata_t hv;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
+	if (obj == NULL)
+		return NULL;
+	hv.bs = lock ? Lock : Unlock;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, lock ? 12 : 16, 0);
+	hv.bq4 = 1;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
+	hv.bs = "";
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, 1, 0);
+	return obj;
+}
+
+static void exword_parse_file(exword_t *self, obex_object_t *obj, char **buffer, int *len)
+{
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hv_size;
+	while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
+		if (hi == OBEX_HDR_BODY) {
+			*buffer = (char *)obex_object_take_body(obj, &hv_size);
+			*len = hv_size;
+			break;
+		}
+	}
+}
+
+static void exword_parse_list(exword_t *self, obex_object_t *obj, exword_dirent_t **entries, uint16_t *count)
+{
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hv_size;
+	int i, size;
+	while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
+		if (hi == OBEX_HDR_BODY) {
+			*count = ntohs(*(uint16_t*)hv.bs);
+			hv.bs += 2;
+			*entries = malloc(sizeof(exword_dirent_t) * (*count + 1));
+			memset(*entries, 0, sizeof(exword_dirent_t) * (*count + 1));
+			for (i = 0; i < *count; i++) {
+				size = ntohs(*(uint16_t*)hv.bs);
+				(*entries)[i].size = size;
+				(*entries)[i].flags = hv.bs[2];
+				(*entries)[i].name = malloc(size - 3);
+				memcpy((*entries)[i].name, hv.bs + 3, size - 3);
+				hv.bs += size;
+			}
+			break;
+		}
+	}
+}
+
+static void exword_parse_model(exword_t *self, obex_object_t *obj, exword_model_t *model)
+{
+	obex_headerdata_t hv;
+	const uint8_t *ptr;
+	uint8_t hi;
+	uint32_t hv_size;
+	while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
+		if (hi == OBEX_HDR_BODY) {
+			model->capabilities = 0;
+			memcpy(model->model, hv.bs, 15);
+			memcpy(model->sub_model, hv.bs + 14, 6);
+			ptr = hv.bs + 23;
+			while (ptr < (hv.bs + hv_size)) {
+				if (memcmp(ptr, "SW", 2) == 0) {
+					model->capabilities |= CAP_SW;
+				} else if (memcmp(ptr, "P", 1) == 0) {
+					model->capabilities |= CAP_P;
+				} else if (memcmp(ptr, "F", 1) == 0) {
+					model->capabilities |= CAP_F;
+				} else if (memcmp(ptr, "CY", 2) == 0) {
+					memcpy(model->ext_model, ptr, 6);
+					model->capabilities |= CAP_EXT;
+				} else if (memcmp(ptr, "C", 1) == 0) {
+					model->capabilities |= CAP_C;
+				}
+				ptr += strlen(ptr) + 1;
+			}
+			break;
+		}
+	}
+}
+
+static void exword_parse_capacity(exword_t *self, obex_object_t *obj, exword_capacity_t *cap)
+{
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hv_size;
+	while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
+		if (hi == OBEX_HDR_BODY) {
+			memcpy(cap, hv.bs, sizeof(exword_capacity_t));
+			cap->total = ntohl(cap->total);
+			cap->free = ntohl(cap->free);
+			break;
+		}
+	}
+}
+
+static void exword_parse_cryptkey(exword_t *self, obex_object_t *obj, exword_cryptkey_t *key)
+{
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hv_size;
+	while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
+		if (hi == OBEX_HDR_BODY) {
+			memcpy(key->key, hv.bs, 12);
+			break;
+		}
+	}
+}
+
+/* Create a session on device. The session takes over ctx if this
+ * succeeds, the handle used to read the descriptors is kept for it. */
+static exword_t * exword_open_usb(libusb_context *ctx, libusb_device *device,
+				  struct libusb_device_descriptor *desc, uint16_t options)
+{
+	uint8_t ver, locale;
+	libusb_device_handle *dev;
+
+	locale = options & 0xff;
+	if (options & OPEN_TEXT)
+		ver = locale;
+	else if (options & OPEN_CD)
+		ver = 0xf0;
+	else
+		ver = locale - 0x0f;
+
+	exword_t *self = malloc(sizeof(exword_t));
+	if (self == NULL)
+		return NULL;
+	memset(self, 0, sizeof(exword_t));
+	if (libusb_open(device, &dev) < 0)
+		goto error;
+	self->vid = desc->idVendor;
+	self->pid = desc->idProduct;
+	libusb_get_string_descriptor_ascii(dev, desc->iManufacturer, self->manufacturer, 20);
+	libusb_get_string_descriptor_ascii(dev, desc->iProduct, self->product, 20);
+
+	self->obex_ctx = obex_init(ctx, dev,
+				   options & OPEN_EVENT_THREAD ? OBEX_FL_EVENT_THREAD : 0);
+	if (self->obex_ctx == NULL) {
+		libusb_close(dev);
+		goto error;
+	}
+	obex_set_connect_info(self->obex_ctx, ver, locale);
+	obex_register_callback(self->obex_ctx, exword_handle_callbacks, self);
+	INIT_LIST_HEAD(&self->async_queue);
+	pthread_mutex_init(&self->mutex, NULL);
+	pthread_cond_init(&self->cond, NULL);
+	return self;
+
+error:
+	free(self);
+	return NULL;
+}
+
+exword_t * exword_open()
+{
+	return exword_open2(0x0020);
+}
+
+static int exword_is_device(libusb_device *device, struct libusb_device_descriptor *desc)
+{
+	if (libusb_get_device_descriptor(device, desc) < 0)
+		return 0;
+	return desc->idVendor == 0x07cf && desc->idProduct == 0x6101;
+}
+
+static void exword_locate(libusb_device *device, exword_device_t *info)
+{
+	int n;
+	memset(info, 0, sizeof(exword_device_t));
+	info->bus = libusb_get_bus_number(device);
+	info->address = libusb_get_device_address(device);
+	n = libusb_get_port_numbers(device, info->ports, sizeof(info->ports));
+	info->depth = n < 0 ? 0 : n;
+}
+
+static int exword_same_device(libusb_device *device, const exword_device_t *want)
+{
+	exword_device_t info;
+	exword_locate(device, &info);
+	if (info.bus != want->bus)
+		return 0;
+	/* The port path survives plugging the device in again, the address not */
+	if (want->depth > 0)
+		return info.depth == want->depth &&
+		       memcmp(info.ports, want->ports, want->depth) == 0;
+	return info.address == want->address;
+}
+
+static void exword_describe(libusb_device *device, struct libusb_device_descriptor *desc,
+			    exword_device_t *info)
+{
+	libusb_device_handle *dev;
+	exword_locate(device, info);
+	/* A device busy elsewhere is still described, just without strings */
+	if (libusb_open(device, &dev) < 0)
+		return;
+	if (desc->iManufacturer)
+		libusb_get_string_descriptor_ascii(dev, desc->iManufacturer,
+			(unsigned char *)info->manufacturer, sizeof(info->manufacturer));
+	if (desc->iProduct)
+		libusb_get_string_descriptor_ascii(dev, desc->iProduct,
+			(unsigned char *)info->product, sizeof(info->product));
+	if (desc->iSerialNumber)
+		libusb_get_string_descriptor_ascii(dev, desc->iSerialNumber,
+			(unsigned char *)info->serial, sizeof(info->serial));
+	libusb_close(dev);
+}
+
+/** @ingroup device
+ * Lists attached devices.
+ * The returned array must be freed with free().
+ * @param[out] devices array of device descriptions
+ * @return number of devices found or -1 on error
+ */
+int exword_enumerate(exword_device_t **devices)
+{
+	int i, count = 0;
+	ssize_t ret;
+	struct libusb_device_descriptor desc;
+	libusb_context *ctx;
+	libusb_device **dev_list = NULL;
+	exword_device_t *list;
+
+	*devices = NULL;
+	ctx = obex_usb_init(0);
+	if (ctx == NULL)
+		return -1;
+	ret = libusb_get_device_list(ctx, &dev_list);
+	if (ret < 0) {
+		obex_usb_exit(ctx, 0);
+		return -1;
+	}
+	list = calloc(ret + 1, sizeof(exword_device_t));
+	for (i = 0; list != NULL && i < ret; i++) {
+		if (!exword_is_device(dev_list[i], &desc))
+			continue;
+		exword_describe(dev_list[i], &desc, &list[count]);
+		count++;
+	}
+	libusb_free_device_list(dev_list, 1);
+	obex_usb_exit(ctx, 0);
+	if (list == NULL)
+		return -1;
+	*devices = list;
+	return count;
+}
+
+/** @ingroup device
+ * Opens device.
+ * This function will open the first attached device using the specified
+ * mode and region.
+ * @param options bit mask of mode and region
+ * @returns pointer to a device handle.
+ */
+exword_t * exword_open2(uint16_t options)
+{
+	return exword_open_device(NULL, options);
+}
+
+/** @ingroup device
+ * Opens a specific device.
+ * Like \ref exword_open2, but opens the device described by device, as
+ * returned by \ref exword_enumerate. Handles of different devices are
+ * independent and may be used from different threads at the same time.
+ * @param device device to open, NULL for the first one found
+ * @param options bit mask of mode and region
+ * @returns pointer to a device handle.
+ */
+exword_t * exword_open_device(const exword_device_t *device, uint16_t options)
+{
+	int i, flags;
+	ssize_t ret;
+	struct libusb_device_descriptor desc;
+	libusb_context *ctx;
+	libusb_device **dev_list = NULL;
+	exword_t *self = NULL;
+
+	flags = options & OPEN_EVENT_THREAD ? OBEX_FL_EVENT_THREAD : 0;
+	ctx = obex_usb_init(flags);
+	if (ctx == NULL)
+		return NULL;
+
+	ret = libusb_get_device_list(ctx, &dev_list);
+	if (ret < 0) {
+		obex_usb_exit(ctx, flags);
+		return NULL;
+	}
+	for (i = 0; self == NULL && i < ret; i++) {
+		if (!exword_is_device(dev_list[i], &desc))
+			continue;
+		if (device != NULL && !exword_same_device(dev_list[i], device))
+			continue;
+		self = exword_open_usb(ctx, dev_list[i], &desc, options);
+	}
+	libusb_free_device_list(dev_list, 1);
+
+	if (self == NULL)
+		obex_usb_exit(ctx, flags);
+	return self;
+}
+
+/** @ingroup device
+ * Closes device.
+ * This function closes the device and performs necessary cleanup.
+ * Queued asynchronous commands are cancelled, their handles still have
+ * to be freed with \ref exword_async_free. No other thread may use the
+ * device handle anymore once this is called.
+ * @param self device handle
+ */
+void exword_close(exword_t *self)
+{
+	exword_async_t *h;
+	if (self) {
+		/* Complete what is still queued, the handles stay with the user */
+		pthread_mutex_lock(&self->mutex);
+		while (!list_empty(&self->async_queue)) {
+			h = list_entry(self->async_queue.next, exword_async_t, link);
+			exword_async_cancel_locked(h);
+			exword_async_wait_locked(h);
+		}
+		pthread_mutex_unlock(&self->mutex);
+		obex_cleanup(self->obex_ctx);
+		pthread_cond_destroy(&self->cond);
+		pthread_mutex_destroy(&self->mutex);
+		free(self->cb_filename);
+		free(self);
+	}
+}
+
+/* Runs in the event thread, the events are handled by
+ * exword_hotplug_handle_events */
+static int LIBUSB_CALL exword_hotplug_cb(libusb_context *ctx, libusb_device *device,
+					 libusb_hotplug_event event, void *user_data)
+{
+	exword_hotplug_t *hp = user_data;
+	struct hotplug_event *e;
+
+	e = malloc(sizeof(struct hotplug_event));
+	if (e == NULL)
+		return 0;
+	e->device = libusb_ref_device(device);
+	e->event = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? HOTPLUG_ARRIVED : HOTPLUG_LEFT;
+	pthread_mutex_lock(&hp->lock);
+	list_add_tail(&e->link, &hp->events);
+	pthread_cond_signal(&hp->cond);
+	pthread_mutex_unlock(&hp->lock);
+	return 0;
+}
+
+static struct hotplug_device *exword_hotplug_find(exword_hotplug_t *hp, libusb_device *device)
+{
+	struct hotplug_device *d;
+	list_for_each_entry(d, &hp->devices, link) {
+		if (d->device == device)
+			return d;
+	}
+	return NULL;
+}
+
+static void exword_hotplug_arrived(exword_hotplug_t *hp, libusb_device *device)
+{
+	struct libusb_device_descriptor desc;
+	struct hotplug_device *d;
+	libusb_context *ctx;
+
+	if (exword_hotplug_find(hp, device) != NULL ||
+	    libusb_get_device_descriptor(device, &desc) < 0)
+		return;
+	d = calloc(1, sizeof(struct hotplug_device));
+	if (d == NULL)
+		return;
+	d->device = libusb_ref_device(device);
+	exword_describe(device, &desc, &d->info);
+	list_add_tail(&d->link, &hp->devices);
+
+	/* Open the device we were told about instead of searching the bus,
+	   the session shares the event thread it belongs to */
+	if (hp->auto_connect) {
+		ctx = obex_usb_init(OBEX_FL_EVENT_THREAD);
+		if (ctx != NULL) {
+			d->handle = exword_open_usb(ctx, device, &desc,
+						    hp->options | OPEN_EVENT_THREAD);
+			if (d->handle == NULL) {
+				obex_usb_exit(ctx, OBEX_FL_EVENT_THREAD);
+			} else if (exword_connect(d->handle) != 0x20) {
+				exword_close(d->handle);
+				d->handle = NULL;
+			}
+		}
+	}
+	if (hp->cb)
+		hp->cb(hp, &d->info, d->handle, HOTPLUG_ARRIVED, hp->user_data);
+}
+
+static void exword_hotplug_remove(exword_hotplug_t *hp, struct hotplug_device *d)
+{
+	list_del(&d->link);
+	if (d->handle)
+		exword_close(d->handle);
+	libusb_unref_device(d->device);
+	free(d);
+}
+
+static void exword_hotplug_left(exword_hotplug_t *hp, libusb_device *device)
+{
+	struct hotplug_device *d;
+
+	d = exword_hotplug_find(hp, device);
+	if (d == NULL)
+		return;
+	if (hp->cb)
+		hp->cb(hp, &d->info, d->handle, HOTPLUG_LEFT, hp->user_data);
+	exword_hotplug_remove(hp, d);
+}
+
+/** @ingroup hotplug
+ * Creates a hotplug manager.
+ * Watches for dictionaries being plugged in or removed. Devices already
+ * attached are reported as arriving. Notifications are delivered by
+ * \ref exword_hotplug_handle_events.
+ * @param cb function called for each device arriving or leaving
+ * @param user_data data pointer passed to cb
+ * @return hotplug manager, NULL on error or if the platform does not
+ *         support hotplug notifications
+ */
+exword_hotplug_t * exword_hotplug_new(hotplug_cb cb, void *user_data)
+{
+	exword_hotplug_t *hp;
+	int ret;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return NULL;
+	hp = calloc(1, sizeof(exword_hotplug_t));
+	if (hp == NULL)
+		return NULL;
+	pthread_mutex_init(&hp->lock, NULL);
+	pthread_cond_init(&hp->cond, NULL);
+	INIT_LIST_HEAD(&hp->events);
+	INIT_LIST_HEAD(&hp->devices);
+	hp->cb = cb;
+	hp->user_data = user_data;
+
+	/* Arrivals are reported by the event thread, no need to poll */
+	hp->usb_ctx = obex_usb_init(OBEX_FL_EVENT_THREAD);
+	if (hp->usb_ctx == NULL)
+		goto error;
+	ret = libusb_hotplug_register_callback(hp->usb_ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, 0x07cf, 0x6101, LIBUSB_HOTPLUG_MATCH_ANY,
+			exword_hotplug_cb, hp, &hp->cb_handle);
+	if (ret < 0) {
+		obex_usb_exit(hp->usb_ctx, OBEX_FL_EVENT_THREAD);
+		goto error;
+	}
+	return hp;
+
+error:
+	pthread_cond_destroy(&hp->cond);
+	pthread_mutex_destroy(&hp->lock);
+	free(hp);
+	return NULL;
+}
+
+/** @ingroup hotplug
+ * Connects to devices as they arrive.
+ * Each arriving device is opened with options and sent the connect
+ * command before the callback is called. The sessions always use the
+ * usb event thread, as if opened with \ref OPEN_EVENT_THREAD.
+ * @param hp hotplug manager
+ * @param enable 1 to connect automatically, 0 to only notify
+ * @param options bit mask of mode and region, see \ref exword_open2
+ */
+void exword_hotplug_auto_connect(exword_hotplug_t *hp, int enable, uint16_t options)
+{
+	hp->auto_connect = enable;
+	hp->options = options;
+}
+
+/** @ingroup hotplug
+ * Handles pending hotplug notifications.
+ * Waits for devices to arrive or leave and calls the callback passed to
+ * \ref exword_hotplug_new for each of them.
+ * @param hp hotplug manager
+ * @param timeout maximum time to wait in milliseconds, 0 to only handle
+ *        what is pending and -1 to wait until something happens
+ * @return number of notifications handled
+ */
+int exword_hotplug_handle_events(exword_hotplug_t *hp, int timeout)
+{
+	struct hotplug_event *e;
+	struct timespec ts;
+	int n = 0;
+
+	pthread_mutex_lock(&hp->lock);
+	if (timeout < 0) {
+		while (list_empty(&hp->events))
+			pthread_cond_wait(&hp->cond, &hp->lock);
+	} else if (timeout > 0 && list_empty(&hp->events)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&hp->cond, &hp->lock, &ts);
+	}
+	while (!list_empty(&hp->events)) {
+		e = list_entry(hp->events.next, struct hotplug_event, link);
+		list_del(&e->link);
+		/* Opening and connecting take a while, keep the queue open */
+		pthread_mutex_unlock(&hp->lock);
+		if (e->event == HOTPLUG_ARRIVED)
+			exword_hotplug_arrived(hp, e->device);
+		else
+			exword_hotplug_left(hp, e->device);
+		libusb_unref_device(e->device);
+		free(e);
+		n++;
+		pthread_mutex_lock(&hp->lock);
+	}
+	pthread_mutex_unlock(&hp->lock);
+	return n;
+}
+
+/** @ingroup hotplug
+ * Frees a hotplug manager.
+ * Sessions opened by auto connect are closed, without calling the
+ * callback.
+ * @param hp hotplug manager
+ */
+void exword_hotplug_free(exword_hotplug_t *hp)
+{
+	struct hotplug_event *e, *en;
+	struct hotplug_device *d, *dn;
+
+	if (hp == NULL)
+		return;
+	libusb_hotplug_deregister_callback(hp->usb_ctx, hp->cb_handle);
+	list_for_each_entry_safe(e, en, &hp->events, link) {
+		list_del(&e->link);
+		libusb_unref_device(e->device);
+		free(e);
+	}
+	list_for_each_entry_safe(d, dn, &hp->devices, link)
+		exword_hotplug_remove(hp, d);
+	obex_usb_exit(hp->usb_ctx, OBEX_FL_EVENT_THREAD);
+	pthread_cond_destroy(&hp->cond);
+	pthread_mutex_destroy(&hp->lock);
+	free(hp);
+}
+
+/** @ingroup misc
+ * Sets the debug message level.
+ * This function sets the debug level for the currentlt opened device.
+ * @param self device handle
+ * @param level debug level (0-5)
+ */
+void exword_set_debug(exword_t *self, int level)
+{
+	self->obex_ctx->debug = level;
+}
+
+/** @ingroup misc
+ * Sets the number of upload packets kept in flight.
+ * When greater than one, \ref exword_send_file will queue up to depth
+ * packets on the bus before waiting for the response to the oldest one,
+ * which keeps the usb link busy during large uploads. The commands of a
+ * batch are kept in flight the same way. The default of 1 waits for
+ * each response before sending the next packet.
+ * @param self device handle
+ * @param depth number of packets (1-8)
+ * @return depth in use or -1 on error
+ */
+int exword_set_queue_depth(exword_t *self, int depth)
+{
+	int ret = -1;
+	pthread_mutex_lock(&self->mutex);
+	/* The packet slots belong to the running command */
+	if (list_empty(&self->async_queue))
+		ret = obex_set_queue_depth(self->obex_ctx, depth);
+	pthread_mutex_unlock(&self->mutex);
+	return ret;
+}
+
+/** @ingroup misc
+ * Enables reading responses ahead.
+ * Every packet is answered by the device with a one byte sequence
+ * number followed by the response. With read-ahead enabled both reads
+ * are queued as soon as the packet is sent instead of one after the
+ * other, saving a usb turnaround per packet.
+ * @param self device handle
+ * @param enable non-zero to enable read-ahead
+ */
+void exword_set_read_ahead(exword_t *self, int enable)
+{
+	obex_set_read_ahead(self->obex_ctx, enable);
+}
+
+/** @ingroup misc
+ * Limits the packet size used for uploads.
+ * By default packets are as large as the MTU advertised by the device
+ * during connect. This sets an upper limit on top of that.
+ * @param self device handle
+ * @param mtu largest packet to send in bytes
+ */
+void exword_set_mtu(exword_t *self, uint16_t mtu)
+{
+	obex_set_mtu(self->obex_ctx, mtu);
+}
+
+/** @ingroup misc
+ * Returns the packet size currently used for uploads.
+ * @param self device handle
+ * @return packet size in bytes
+ */
+uint16_t exword_get_mtu(exword_t *self)
+{
+	return self->obex_ctx->mtu_tx;
+}
+
+/** @ingroup misc
+ * Sets the largest packet the device may send.
+ * Larger packets mean fewer round trips when downloading files.
+ * @note must be called before \ref exword_connect.
+ * @param self device handle
+ * @param mtu largest packet to receive in bytes
+ * @return 0 on success, -1 if already connected
+ */
+int exword_set_mtu_rx(exword_t *self, uint16_t mtu)
+{
+	return obex_set_mtu_rx(self->obex_ctx, mtu);
+}
+
+/** @ingroup misc
+ * Returns the current round trip time estimate.
+ * Every packet is timed from being sent until its response arrives and
+ * the usb transfer timeout is derived from these measurements. A last
+ * value far above srtt is a sign of a stalled device.
+ * @param[in] self device handle
+ * @param[out] rtt round trip time estimate
+ */
+void exword_get_rtt(exword_t *self, exword_rtt_t *rtt)
+{
+	obex_get_rtt(self->obex_ctx, &rtt->srtt, &rtt->rttvar, &rtt->last, &rtt->timeout);
+}
+
+static void exword_async_release(exword_async_t *h)
+{
+	free(h->buffer);
+	if (h->entries)
+		exword_free_list(h->entries);
+	free(h);
+}
+
+/* Record the result of a command and take it off the queue. Called with
+ * the mutex held, like all of the following. */
+static void exword_async_finish(exword_async_t *h, int rsp)
+{
+	exword_t *self = h->device;
+	if (h->type != ASYNC_SYNC) {
+		if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
+			if (h->type == ASYNC_GET_FILE)
+				exword_parse_file(self, h->obj, &h->buffer, &h->len);
+			else if (h->type == ASYNC_LIST)
+				exword_parse_list(self, h->obj, &h->entries, &h->count);
+		}
+		obex_object_delete(self->obex_ctx, h->obj);
+		h->obj = NULL;
+	}
+	h->rsp = rsp;
+	h->state = ASYNC_DONE;
+	h->in_callback = h->cb != NULL;
+	h->cb_thread = pthread_self();
+	list_del(&h->link);
+	pthread_cond_broadcast(&self->cond);
+}
+
+/* Call the completion callback of a finished command. The mutex is
+ * dropped meanwhile, so the callback may queue or wait for commands and
+ * free the handle. */
+static void exword_async_notify(exword_async_t *h)
+{
+	exword_t *self = h->device;
+	if (!h->in_callback)
+		return;
+	pthread_mutex_unlock(&self->mutex);
+	h->cb(h, h->rsp, h->user_data);
+	pthread_mutex_lock(&self->mutex);
+	h->in_callback = 0;
+	pthread_cond_broadcast(&self->cond);
+	if (h->freed)
+		exword_async_release(h);
+}
+
+static void exword_async_start(exword_t *self)
+{
+	exword_async_t *h;
+	while (!list_empty(&self->async_queue)) {
+		h = list_entry(self->async_queue.next, exword_async_t, link);
+		if (h->state == ASYNC_RUNNING)
+			return;
+		if (obex_request_start_batch(self->obex_ctx, h->batch, h->batch_count) == 0) {
+			h->state = ASYNC_RUNNING;
+			return;
+		}
+		exword_async_finish(h, -1);
+		exword_async_notify(h);
+	}
+}
+
+/* Handle device events for at most tv (forever if NULL) and complete the
+ * running command if it finished. Only one thread handles the events of
+ * a device at a time, the mutex is dropped while it does. */
+static void exword_async_drive(exword_t *self, struct timeval *tv)
+{
+	exword_async_t *h;
+	int done;
+
+	exword_async_start(self);
+	if (self->driving || list_empty(&self->async_queue))
+		return;
+	h = list_entry(self->async_queue.next, exword_async_t, link);
+	self->driving = 1;
+	pthread_mutex_unlock(&self->mutex);
+	done = obex_request_step(self->obex_ctx, tv);
+	pthread_mutex_lock(&self->mutex);
+	self->driving = 0;
+	if (done) {
+		exword_async_finish(h, obex_request_result(self->obex_ctx));
+		/* Get the next command going before calling back */
+		exword_async_start(self);
+		exword_async_notify(h);
+	}
+	pthread_cond_broadcast(&self->cond);
+}
+
+static int exword_async_wait_locked(exword_async_t *h)
+{
+	exword_t *self = h->device;
+	while (h->state != ASYNC_DONE) {
+		if (self->driving)
+			pthread_cond_wait(&self->cond, &self->mutex);
+		else
+			exword_async_drive(self, NULL);
+	}
+	return h->rsp;
+}
+
+static int exword_async_cancel_locked(exword_async_t *h)
+{
+	exword_t *self = h->device;
+	if (h->state == ASYNC_DONE)
+		return -1;
+	if (h->state == ASYNC_QUEUED) {
+		exword_async_finish(h, LIBUSB_ERROR_INTERRUPTED);
+		exword_async_notify(h);
+		return 0;
+	}
+	return obex_request_abort(self->obex_ctx);
+}
+
+static exword_async_t * exword_async_queue(exword_t *self, obex_object_t *obj, int type,
+					   async_cb cb, void *user_data)
+{
+	exword_async_t *h;
+	if (obj == NULL)
+		return NULL;
+	h = malloc(sizeof(exword_async_t));
+	if (h == NULL) {
+		obex_object_delete(self->obex_ctx, obj);
+		return NULL;
+	}
+	memset(h, 0, sizeof(exword_async_t));
+	h->device = self;
+	h->obj = obj;
+	h->batch = &h->obj;
+	h->batch_count = 1;
+	h->type = type;
+	h->state = ASYNC_QUEUED;
+	h->rsp = -1;
+	h->cb = cb;
+	h->user_data = user_data;
+	pthread_mutex_lock(&self->mutex);
+	list_add_tail(&h->link, &self->async_queue);
+	exword_async_start(self);
+	pthread_mutex_unlock(&self->mutex);
+	return h;
+}
+
+/* Send objs back to back once the commands queued before them are done
+ * and wait for the responses. The objects are left to the caller. */
+static int exword_request_batch(exword_t *self, obex_object_t **objs, int count)
+{
+	exword_async_t h;
+	memset(&h, 0, sizeof(exword_async_t));
+	h.device = self;
+	h.batch = objs;
+	h.batch_count = count;
+	h.type = ASYNC_SYNC;
+	h.state = ASYNC_QUEUED;
+	h.rsp = -1;
+	pthread_mutex_lock(&self->mutex);
+	list_add_tail(&h.link, &self->async_queue);
+	exword_async_wait_locked(&h);
+	pthread_mutex_unlock(&self->mutex);
+	return h.rsp;
+}
+
+static int exword_request(exword_t *self, obex_object_t *obj)
+{
+	return exword_request_batch(self, &obj, 1);
+}
+
+/** @ingroup misc
+ * Returns the file descriptors to watch for device events.
+ * When any of them becomes ready, or \ref exword_get_timeout expires,
+ * \ref exword_process_events has to be called. The set may change while
+ * the device is open, see \ref exword_set_pollfd_notifiers. A device
+ * opened with \ref OPEN_EVENT_THREAD has a single descriptor that never
+ * changes and no timeout.
+ * @param[in] self device handle
+ * @param[out] fds array receiving the file descriptors
+ * @param[in] max number of entries in fds
+ * @return number of file descriptors, which may be more than max, or -1 on error
+ */
+int exword_get_pollfds(exword_t *self, exword_pollfd_t *fds, int max)
+{
+	const struct libusb_pollfd **pollfds;
+	int i;
+
+	pollfds = obex_get_pollfds(self->obex_ctx);
+	if (pollfds == NULL)
+		return -1;
+	for (i = 0; pollfds[i] != NULL; i++) {
+		if (i < max) {
+			fds[i].fd = pollfds[i]->fd;
+			fds[i].events = pollfds[i]->events;
+		}
+	}
+	obex_free_pollfds(self->obex_ctx, pollfds);
+	return i;
+}
+
+/** @ingroup misc
+ * Returns the time until \ref exword_process_events has to be called
+ * even if none of the file descriptors became ready.
+ * @param self device handle
+ * @return timeout in milliseconds, -1 if there is none
+ */
+int exword_get_timeout(exword_t *self)
+{
+	return obex_get_timeout(self->obex_ctx);
+}
+
+/** @ingroup misc
+ * Registers callbacks for changes to the watched file descriptors.
+ * @param self device handle
+ * @param added called for each file descriptor to start watching
+ * @param removed called for each file descriptor to stop watching
+ * @param user_data data pointer passed to both callbacks
+ */
+void exword_set_pollfd_notifiers(exword_t *self, pollfd_added_cb added,
+				 pollfd_removed_cb removed, void *user_data)
+{
+	obex_set_pollfd_notifiers(self->obex_ctx, added, removed, user_data);
+}
+
+/** @ingroup misc
+ * Handles pending device events without blocking.
+ * Advances the queued asynchronous commands as far as the device allows
+ * and returns right away, so it can be called from an existing event loop
+ * whenever one of the file descriptors from \ref exword_get_pollfds is
+ * ready. Completion callbacks are called from here.
+ * @param self device handle
+ * @return 1 if no command is queued anymore, 0 otherwise
+ */
+int exword_process_events(exword_t *self)
+{
+	struct timeval tv = { 0, 0 };
+	int empty;
+	pthread_mutex_lock(&self->mutex);
+	exword_async_drive(self, &tv);
+	empty = list_empty(&self->async_queue);
+	pthread_mutex_unlock(&self->mutex);
+	return empty;
+}
+
+#define TUNE_FILE	"mtutune%d.bin"
+#define TUNE_FILES	10
+#define TUNE_SIZE	(256 * 1024)
+
+/* Picks a scratch file name not used in the current path, so tuning never
+ * overwrites and then removes a file of the user */
+static int exword_tune_file(exword_t *self, char *name)
+{
+	exword_dirent_t *entries;
+	uint16_t count;
+	int i, n, rsp;
+
+	rsp = exword_list(self, &entries, &count);
+	if (rsp != 0x20)
+		return rsp;
+	for (n = 0; n < TUNE_FILES; n++) {
+		sprintf(name, TUNE_FILE, n);
+		for (i = 0; i < count; i++) {
+			if (!(entries[i].flags & 2) &&
+			    strcasecmp((char *) entries[i].name, name) == 0)
+				break;
+		}
+		if (i == count)
+			break;
+	}
+	if (entries != NULL)
+		exword_free_list(entries);
+	return n < TUNE_FILES ? 0x20 : -1;
+}
+
+/** @ingroup misc
+ * Picks the fastest packet size for uploads.
+ * Uploads a scratch file to the current path once for each of several
+ * packet sizes up to the device's MTU, or the limit set with
+ * \ref exword_set_mtu if lower, and keeps the size with the best
+ * throughput. The scratch file gets a name not used in the current path
+ * and is removed afterwards. If no size could be
+ * measured the previous limit set with \ref exword_set_mtu is kept.
+ * @note must be called while connected, and the current path must be writable.
+ * Every call writes the scratch file several times, so callers should keep
+ * the result instead of tuning on each connect.
+ * @param[in] self device handle
+ * @param[out] mtu selected packet size (may be NULL)
+ * @return response code
+ */
+int exword_tune_mtu(exword_t *self, uint16_t *mtu)
+{
+	static const uint16_t sizes[] = { 4096, 8192, 16384, 32768, 65535 };
+	uint16_t peer, limit, cap, size, best = 0;
+	double rate, best_rate = 0;
+	struct timeval start, end;
+	char name[16], *buffer;
+	int i, rsp = 0x20;
+
+	peer = self->obex_ctx->mtu_tx_peer;
+	if (peer == 0)
+		return -1;
+	/* never probe past the limit set with exword_set_mtu */
+	limit = self->obex_ctx->mtu_tx_max;
+	cap = peer < limit ? peer : limit;
+	rsp = exword_tune_file(self, name);
+	if (rsp != 0x20)
+		return rsp;
+	buffer = calloc(TUNE_SIZE, 1);
+	if (buffer == NULL)
+		return -1;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size = sizes[i] < cap ? sizes[i] : cap;
+		obex_set_mtu(self->obex_ctx, size);
+		gettimeofday(&start, NULL);
+		rsp = exword_send_file(self, name, buffer, TUNE_SIZE);
+		gettimeofday(&end, NULL);
+		if (rsp != 0x20)
+			break;
+		rate = TUNE_SIZE / ((end.tv_sec - start.tv_sec) +
+				    (end.tv_usec - start.tv_usec) / 1000000.0 + 1e-6);
+		DEBUG(self->obex_ctx, 1, "MTU %d: %.0f bytes/s\n", size, rate);
+		if (rate > best_rate) {
+			best_rate = rate;
+			best = size;
+		}
+		if (size == cap)
+			break;
+	}
+	exword_remove_file(self, name, 0);
+	obex_set_mtu(self->obex_ctx, best ? best : limit);
+	if (mtu)
+		*mtu = self->obex_ctx->mtu_tx;
+	free(buffer);
+	return best ? 0x20 : rsp;
+}
+
+/** @ingroup misc
+ * Registers callback functions for sending and recieving files.
+ * These functions will be invoked during file transfers after each
+ * chunk of the file is transferred.\n\n
+ * To remove a callback use NULL for function pointer
+ * @param self device handle
+ * @param get pointer to function for reporting download transfer progress
+ * @param put pointer to function for reporting upload transfer progress
+ * @param userdata pointer passed to callback functions
+ */
+void exword_register_callbacks(exword_t *self, file_cb get, file_cb put, void *userdata)
+{
+	self->put_file_cb = put;
+	self->get_file_cb = get;
+	self->cb_userdata = userdata;
+}
+
+/** @ingroup misc
+ * Cancels the command in progress.
+ * Meant to be called from a progress callback registered with
+ * \ref exword_register_callbacks or from a signal handler while a file
+ * is being transferred. Packets already sent are answered first, then the
+ * transfer is ended with an OBEX abort so the device is ready for the
+ * next command. The interrupted command returns LIBUSB_ERROR_INTERRUPTED,
+ * unless it was already finishing, in which case it completes normally.
+ * If no command is being sent, e.g. when a signal arrives just before a
+ * transfer starts, the next command returns LIBUSB_ERROR_INTERRUPTED
+ * without sending anything.
+ * @param self device handle
+ */
+void exword_cancel(exword_t *self)
+{
+	obex_request_abort(self->obex_ctx);
+}
+
+/** @ingroup cmd
+ * Send connect command.
+ * @note Any commands sent before this will fail.
+ * @param self device handle
+ * @return response code
+ */
+int exword_connect(exword_t *self)
+{
+	int rsp;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_CONNECT);
+	if (obj == NULL)
+		return -1;
+	rsp = exword_request(self, obj);
+	obex_object_delete(self->obex_ctx, obj);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Upload a file to device.
+ * This command will write the given file data as file filename to the device.
+ * @param self device handle
+ * @param filename name of file being sent.
+ * @param buffer pointer to file data.
+ * @param len size of buffer.
+ * @return response code
+ */
+int exword_send_file(exword_t *self, char* filename, char *buffer, int len)
+{
+	int rsp;
+	obex_object_t *obj = exword_send_file_object(self, filename, buffer, len);
+	if (obj == NULL)
+		return -1;
+	rsp = exword_request(self, obj);
+	obex_object_delete(self->obex_ctx, obj);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Upload a file to device from a stream.
+ * Like \ref exword_send_file, but the file data is pulled from the read
+ * callback one packet at a time instead of being passed in a buffer, so
+ * only a single packet worth of data is held in memory.
+ * @param self device handle
+ * @param filename name of file being sent.
+ * @param len total size of file.
+ * @param read callback supplying the file data.
+ * @param userdata pointer passed to read callback.
+ * @return response code
+ */
+int exword_send_stream(exword_t *self, char* filename, int len, read_cb read, void *userdata)
+{
+	int length, rsp;
+	obex_headerdata_t hv;
+	char *unicode;
+	unicode = locale_to_utf16(&unicode, &length, filename, strlen(filename) + 1);
+	if (unicode == NULL)
+		return -1;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
+	if (obj == NULL) {
+		free(unicode);
+		return -1;
+	}
+	hv.bs = unicode;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, length, 0);
+	hv.bq4 = len;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
+	if (obex_object_add_stream(self->obex_ctx, obj, len, read, userdata) < 0) {
+		obex_object_delete(self->obex_ctx, obj);
+		free(unicode);
+		return -1;
+	}
+	rsp = exword_request(self, obj);
+	obex_object_delete(self->obex_ctx, obj);
+	free(unicode);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Download a file from device.
+ * This command will read a file from the device.
+ * @note buffer is allocated by the function and must be freed by the user.
+ * @param[in] self device handle
+ * @param[in] filename name of file being sent.
+ * @param[out] buffer pointer to recieved file data.
+ * @param[out] len size of buffer.
+ * @return response code
+ */
+int exword_get_file(exword_t *self, char* filename, char **buffer, int *len)
+{
+	int rsp;
+	obex_object_t *obj;
+	*len = 0;
+	*buffer = NULL;
+	obj = exword_get_file_object(self, filename);
+	if (obj == NULL)
+		return -1;
+	rsp = exword_request(self, obj);
+	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS)
+		exword_parse_file(self, obj, buffer, len);
+	obex_object_delete(self->obex_ctx, obj);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Download a file from device to a stream.
+ * Like \ref exword_get_file, but each piece of file data is passed to the
+ * write callback as soon as it is received instead of being collected
+ * into a buffer.
+ * @param self device handle
+ * @param filename name of file to retrieve.
+ * @param write callback receiving the file data.
+ * @param userdata pointer passed to write callback.
+ * @return response code
+ */
+int exword_get_stream(exword_t *self, char* filename, write_cb write, void *userdata)
+{
+	int length, rsp;
+	char *unicode;
+	obex_headerdata_t hv;
+	unicode = locale_to_utf16(&unicode, &length, filename, strlen(filename) + 1);
+	if (unicode == NULL)
+		return -1;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	if (obj == NULL) {
+		free(unicode);
+		return -1;
+	}
+	hv.bs = unicode;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, length, 0);
+	obex_object_set_body_sink(obj, write, userdata);
+	rsp = exword_request(self, obj);
+	obex_object_delete(self->obex_ctx, obj);
+	free(unicode);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Remove a file from device.
+ * This command will remove the given file from the device.\n\n
+ * Dataplus5 models require convert_to_unicode option when operating in Text mode.
+ * @param self device handle
+ * @param filename name of file being sent
+ * @param convert_to_unicode automatically convert filename to UTF-16 if true
+ * @return response code
+ */
+int exword_remove_file(exword_t *self, char* filename, int convert_to_unicode)
+{
+	int rsp;
+	obex_object_t *obj = exword_remove_file_object(self, filename, convert_to_unicode);
+	if (obj == NULL)
+		return -1;
+	rsp = exword_request(self, obj);
+	obex_object_delete(self->obex_ctx, obj);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Format SD card.
+ * This command will format the inserted SD card.
+ * @param self device handle
+ * @return response code
+ */
+int exword_sd_format(exword_t *self)
+{
+	int rsp, len;
+	obex_headerdata_t hv;
+	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
+	if (obj == NULL) {
+		return -1;
+	}
+	hv.bs = SdFormat;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 20, 0);
+	hv.bq4 = 1;
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
+	hv.bs = "";
+	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, 1, 0);
+	rsp = exword_request(self, obj);
+	obex_object_delete(self->obex_ctx, obj);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Sets the current path on device.
+ * Pathname should start with either \\_INTERNAL_00 or \\_SD_00, which will
+ * access either internal memory or the sd card respectively.\n\n
+ * Passing an empty string for path will allow you to get a list of storage mediums.
+ * @param self device handle
+ * @param path new path
+ * @param mkdir if true create path if non existant
+ * @return response code
+ */
+int exword_setpath(exword_t *self, uint8_t *path, uint8_t mkdir)
 {
 	int rsp;
-	obex_headerdata_t hv;
-	const uint8_t *ptr;
-	uint8_t hi;
-	uint32_t hv_size;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	obex_object_t *obj = exword_setpath_object(self, path, mkdir);
 	if (obj == NULL)
 		return -1;
-	hv.bs = Model;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 14, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
-		while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
-			if (hi == OBEX_HDR_BODY) {
-				model->capabilities = 0;
-				memcpy(model->model, hv.bs, 15);
-				memcpy(model->sub_model, hv.bs + 14, 6);
-				ptr = hv.bs + 23;
-				while (ptr < (hv.bs + hv_size)) {
-					if (memcmp(ptr, "SW", 2) == 0) {
-						model->capabilities |= CAP_SW;
-					} else if (memcmp(ptr, "P", 1) == 0) {
-						model->capabilities |= CAP_P;
-					} else if (memcmp(ptr, "F", 1) == 0) {
-						model->capabilities |= CAP_F;
-					} else if (memcmp(ptr, "CY", 2) == 0) {
-						memcpy(model->ext_model, ptr, 6);
-						model->capabilities |= CAP_EXT;
-					} else if (memcmp(ptr, "C", 1) == 0) {
-						model->capabilities |= CAP_C;
-					}
-					ptr += strlen(ptr) + 1;
-				}
-				break;
-			}
-		}
-	}
+	rsp = exword_request(self, obj);
+	obex_object_delete(self->obex_ctx, obj);
+	return rsp;
+}
+
+/** @ingroup cmd
+ * Get model information.
+ * This function retrieves the model information of the connected device.
+ * @param[in] self device handle
+ * @param[out] model model information
+ * @return response code
+ */
+int exword_get_model(exword_t *self, exword_model_t * model)
+{
+	int rsp;
+	obex_object_t *obj = exword_model_object(self);
+	if (obj == NULL)
+		return -1;
+	rsp = exword_request(self, obj);
+	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS)
+		exword_parse_model(self, obj, model);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -692,25 +1862,12 @@ int exword_get_model(exword_t *self, exword_model_t * model)
 int exword_get_capacity(exword_t *self, exword_capacity_t *cap)
 {
 	int rsp;
-	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hv_size;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	obex_object_t *obj = exword_capacity_object(self);
 	if (obj == NULL)
 		return -1;
-	hv.bs = Cap;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 10, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
-		while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
-			if (hi == OBEX_HDR_BODY) {
-				memcpy(cap, hv.bs, sizeof(exword_capacity_t));
-				cap->total = ntohl(cap->total);
-				cap->free = ntohl(cap->free);
-				break;
-			}
-		}
-	}
+	rsp = exword_request(self, obj);
+	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS)
+		exword_parse_capacity(self, obj, cap);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -727,37 +1884,15 @@ int exword_get_capacity(exword_t *self, exword_capacity_t *cap)
 int exword_list(exword_t *self, exword_dirent_t **entries, uint16_t *count)
 {
 	int rsp;
-	int i, size;
-	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hv_size;
+	obex_object_t *obj;
 	*count = 0;
 	*entries = NULL;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	obj = exword_list_object(self);
 	if (obj == NULL)
 		return -1;
-	hv.bs = List;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 12, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
-		while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
-			if (hi == OBEX_HDR_BODY) {
-				*count = ntohs(*(uint16_t*)hv.bs);
-				hv.bs += 2;
-				*entries = malloc(sizeof(exword_dirent_t) * (*count + 1));
-				memset(*entries, 0, sizeof(exword_dirent_t) * (*count + 1));
-				for (i = 0; i < *count; i++) {
-					size = ntohs(*(uint16_t*)hv.bs);
-					(*entries)[i].size = size;
-					(*entries)[i].flags = hv.bs[2];
-					(*entries)[i].name = malloc(size - 3);
-					memcpy((*entries)[i].name, hv.bs + 3, size - 3);
-					hv.bs += size;
-				}
-				break;
-			}
-		}
-	}
+	rsp = exword_request(self, obj);
+	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS)
+		exword_parse_list(self, obj, entries, count);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -776,6 +1911,416 @@ void exword_free_list(exword_dirent_t *entries)
 	free(entries);
 }
 
+/** @ingroup async
+ * Queue a file upload.
+ * Asynchronous form of \ref exword_send_file.
+ * @note buffer is sent from in place and must stay valid until the command completes.
+ * @param self device handle
+ * @param filename name of file being sent.
+ * @param buffer pointer to file data.
+ * @param len size of buffer.
+ * @param cb completion callback (may be NULL)
+ * @param user_data data pointer passed to cb
+ * @return command handle, NULL on error
+ */
+exword_async_t * exword_send_file_async(exword_t *self, char* filename, char *buffer, int len,
+				       async_cb cb, void *user_data)
+{
+	return exword_async_queue(self, exword_send_file_object(self, filename, buffer, len),
+				  ASYNC_CMD, cb, user_data);
+}
+
+/** @ingroup async
+ * Queue a file download.
+ * Asynchronous form of \ref exword_get_file. The file data is retrieved
+ * with \ref exword_async_file once the command has completed.
+ * @param self device handle
+ * @param filename name of file to retrieve.
+ * @param cb completion callback (may be NULL)
+ * @param user_data data pointer passed to cb
+ * @return command handle, NULL on error
+ */
+exword_async_t * exword_get_file_async(exword_t *self, char* filename,
+				      async_cb cb, void *user_data)
+{
+	return exword_async_queue(self, exword_get_file_object(self, filename),
+				  ASYNC_GET_FILE, cb, user_data);
+}
+
+/** @ingroup async
+ * Queue removal of a file.
+ * Asynchronous form of \ref exword_remove_file.
+ * @param self device handle
+ * @param filename name of file to remove
+ * @param convert_to_unicode automatically convert filename to UTF-16 if true
+ * @param cb completion callback (may be NULL)
+ * @param user_data data pointer passed to cb
+ * @return command handle, NULL on error
+ */
+exword_async_t * exword_remove_file_async(exword_t *self, char* filename, int convert_to_unicode,
+					 async_cb cb, void *user_data)
+{
+	return exword_async_queue(self, exword_remove_file_object(self, filename, convert_to_unicode),
+				  ASYNC_CMD, cb, user_data);
+}
+
+/** @ingroup async
+ * Queue a change of the current path.
+ * Asynchronous form of \ref exword_setpath.
+ * @param self device handle
+ * @param path new path
+ * @param mkdir if true create path if non existant
+ * @param cb completion callback (may be NULL)
+ * @param user_data data pointer passed to cb
+ * @return command handle, NULL on error
+ */
+exword_async_t * exword_setpath_async(exword_t *self, uint8_t *path, uint8_t mkdir,
+				     async_cb cb, void *user_data)
+{
+	return exword_async_queue(self, exword_setpath_object(self, path, mkdir),
+				  ASYNC_CMD, cb, user_data);
+}
+
+/** @ingroup async
+ * Queue a directory listing.
+ * Asynchronous form of \ref exword_list. The entries are retrieved with
+ * \ref exword_async_list once the command has completed.
+ * @param self device handle
+ * @param cb completion callback (may be NULL)
+ * @param user_data data pointer passed to cb
+ * @return command handle, NULL on error
+ */
+exword_async_t * exword_list_async(exword_t *self, async_cb cb, void *user_data)
+{
+	return exword_async_queue(self, exword_list_object(self), ASYNC_LIST, cb, user_data);
+}
+
+/** @ingroup async
+ * Wait for a command to complete.
+ * Blocks handling device events until the command has finished. The
+ * completion callbacks of this and earlier queued commands are called
+ * from here.
+ * @param handle command handle
+ * @return response code
+ */
+int exword_async_wait(exword_async_t *handle)
+{
+	exword_t *self = handle->device;
+	int rsp;
+	pthread_mutex_lock(&self->mutex);
+	rsp = exword_async_wait_locked(handle);
+	pthread_mutex_unlock(&self->mutex);
+	return rsp;
+}
+
+/** @ingroup async
+ * Cancel a command.
+ * A queued command is removed from the queue right away, a running one
+ * is ended with an OBEX abort as described in \ref exword_cancel. Either
+ * way it completes with LIBUSB_ERROR_INTERRUPTED.
+ * @param handle command handle
+ * @return 0 on success, -1 if the command already completed
+ */
+int exword_async_cancel(exword_async_t *handle)
+{
+	exword_t *self = handle->device;
+	int ret;
+	pthread_mutex_lock(&self->mutex);
+	ret = exword_async_cancel_locked(handle);
+	pthread_mutex_unlock(&self->mutex);
+	return ret;
+}
+
+/** @ingroup async
+ * Check whether a command has completed.
+ * @param handle command handle
+ * @return 1 if the command completed, 0 otherwise
+ */
+int exword_async_done(exword_async_t *handle)
+{
+	return handle->state == ASYNC_DONE;
+}
+
+/** @ingroup async
+ * Retrieve the file downloaded by \ref exword_get_file_async.
+ * @note buffer is handed over to the caller and must be freed by the user.
+ * @param[in] handle command handle
+ * @param[out] buffer pointer to recieved file data.
+ * @param[out] len size of buffer.
+ * @return response code, -1 if the command has not completed
+ */
+int exword_async_file(exword_async_t *handle, char **buffer, int *len)
+{
+	*buffer = handle->buffer;
+	*len = handle->len;
+	handle->buffer = NULL;
+	handle->len = 0;
+	return handle->state == ASYNC_DONE ? handle->rsp : -1;
+}
+
+/** @ingroup async
+ * Retrieve the entries listed by \ref exword_list_async.
+ * Entries are handed over to the caller and must be freed with \ref exword_free_list.
+ * @param[in] handle command handle
+ * @param[out] entries array of directory entries
+ * @param[out] count number of elements in entries array
+ * @return response code, -1 if the command has not completed
+ */
+int exword_async_list(exword_async_t *handle, exword_dirent_t **entries, uint16_t *count)
+{
+	*entries = handle->entries;
+	*count = handle->count;
+	handle->entries = NULL;
+	handle->count = 0;
+	return handle->state == ASYNC_DONE ? handle->rsp : -1;
+}
+
+/** @ingroup async
+ * Free a command handle.
+ * A command that has not completed yet is cancelled first. Results that
+ * were not retrieved are freed as well.
+ * @param handle command handle
+ */
+void exword_async_free(exword_async_t *handle)
+{
+	exword_t *self;
+	if (handle == NULL)
+		return;
+	self = handle->device;
+	pthread_mutex_lock(&self->mutex);
+	if (handle->state != ASYNC_DONE) {
+		/* Do not call back into a handle that is going away */
+		handle->cb = NULL;
+		exword_async_cancel_locked(handle);
+		exword_async_wait_locked(handle);
+	}
+	if (handle->in_callback) {
+		/* Freed from its own callback, release it once that returns */
+		if (pthread_equal(handle->cb_thread, pthread_self())) {
+			handle->freed = 1;
+			pthread_mutex_unlock(&self->mutex);
+			return;
+		}
+		while (handle->in_callback)
+			pthread_cond_wait(&self->cond, &self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+	exword_async_release(handle);
+}
+
+/** @ingroup batch
+ * Creates an empty batch.
+ * Commands are added with the exword_batch_* functions and sent with
+ * \ref exword_batch_run. A batch holds up to 16 commands and is run once.
+ * @param self device handle
+ * @return batch or NULL on error
+ */
+exword_batch_t * exword_batch_new(exword_t *self)
+{
+	exword_batch_t *batch;
+	batch = malloc(sizeof(exword_batch_t));
+	if (batch == NULL)
+		return NULL;
+	memset(batch, 0, sizeof(exword_batch_t));
+	batch->device = self;
+	return batch;
+}
+
+static int exword_batch_add(exword_batch_t *batch, obex_object_t *obj, int type,
+			    void *data, uint16_t *count)
+{
+	int i = batch->count;
+	if (obj == NULL)
+		return -1;
+	if (batch->ran || i == BATCH_MAX) {
+		obex_object_delete(batch->device->obex_ctx, obj);
+		return -1;
+	}
+	batch->objs[i] = obj;
+	batch->cmds[i].type = type;
+	batch->cmds[i].data = data;
+	batch->cmds[i].count = count;
+	batch->cmds[i].rsp = -1;
+	batch->count++;
+	return i;
+}
+
+/** @ingroup batch
+ * Adds \ref exword_setpath to a batch.
+ * @param batch batch
+ * @param path new path
+ * @param mkdir if true create path if non existant
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_setpath(exword_batch_t *batch, uint8_t *path, uint8_t mkdir)
+{
+	obex_object_t *obj = exword_setpath_object(batch->device, path, mkdir);
+	return exword_batch_add(batch, obj, BATCH_CMD, NULL, NULL);
+}
+
+/** @ingroup batch
+ * Adds \ref exword_list to a batch.
+ * entries and count are filled in by \ref exword_batch_run.
+ * @param[in] batch batch
+ * @param[out] entries array of directory entries
+ * @param[out] count number of elements in entries array
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_list(exword_batch_t *batch, exword_dirent_t **entries, uint16_t *count)
+{
+	obex_object_t *obj = exword_list_object(batch->device);
+	*count = 0;
+	*entries = NULL;
+	return exword_batch_add(batch, obj, BATCH_LIST, entries, count);
+}
+
+/** @ingroup batch
+ * Adds \ref exword_get_model to a batch.
+ * model is filled in by \ref exword_batch_run.
+ * @param[in] batch batch
+ * @param[out] model model information
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_get_model(exword_batch_t *batch, exword_model_t *model)
+{
+	obex_object_t *obj = exword_model_object(batch->device);
+	return exword_batch_add(batch, obj, BATCH_MODEL, model, NULL);
+}
+
+/** @ingroup batch
+ * Adds \ref exword_get_capacity to a batch.
+ * cap is filled in by \ref exword_batch_run.
+ * @param[in] batch batch
+ * @param[out] cap capacity
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_get_capacity(exword_batch_t *batch, exword_capacity_t *cap)
+{
+	obex_object_t *obj = exword_capacity_object(batch->device);
+	return exword_batch_add(batch, obj, BATCH_CAPACITY, cap, NULL);
+}
+
+/** @ingroup batch
+ * Adds \ref exword_cryptkey to a batch.
+ * key.key is filled in by \ref exword_batch_run.
+ * @param[in] batch batch
+ * @param[in,out] key CryptKey info
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_cryptkey(exword_batch_t *batch, exword_cryptkey_t *key)
+{
+	obex_object_t *obj = exword_cryptkey_object(batch->device, key);
+	return exword_batch_add(batch, obj, BATCH_CRYPTKEY, key, NULL);
+}
+
+/** @ingroup batch
+ * Adds \ref exword_cname to a batch.
+ * @param batch batch
+ * @param name add-on name
+ * @param dir install directory
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_cname(exword_batch_t *batch, char *name, char *dir)
+{
+	obex_object_t *obj = exword_cname_object(batch->device, name, dir);
+	return exword_batch_add(batch, obj, BATCH_CMD, NULL, NULL);
+}
+
+/** @ingroup batch
+ * Adds \ref exword_unlock to a batch.
+ * @param batch batch
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_unlock(exword_batch_t *batch)
+{
+	obex_object_t *obj = exword_lock_object(batch->device, 0);
+	return exword_batch_add(batch, obj, BATCH_CMD, NULL, NULL);
+}
+
+/** @ingroup batch
+ * Adds \ref exword_lock to a batch.
+ * @param batch batch
+ * @return index of the command in the batch or -1 on error
+ */
+int exword_batch_lock(exword_batch_t *batch)
+{
+	obex_object_t *obj = exword_lock_object(batch->device, 1);
+	return exword_batch_add(batch, obj, BATCH_CMD, NULL, NULL);
+}
+
+/** @ingroup batch
+ * Sends the commands of a batch.
+ * This function blocks until every command has been answered. Like the
+ * blocking commands it waits for the commands queued before it. All
+ * commands are sent even if one of them fails, the response of each is
+ * available from \ref exword_batch_response.
+ * @param batch batch
+ * @return first response other than success, or success
+ */
+int exword_batch_run(exword_batch_t *batch)
+{
+	exword_t *self = batch->device;
+	struct batch_cmd *cmd;
+	int i, rsp;
+	if (batch->ran || batch->count == 0)
+		return -1;
+	rsp = exword_request_batch(self, batch->objs, batch->count);
+	for (i = 0; i < batch->count; i++) {
+		cmd = &batch->cmds[i];
+		cmd->rsp = batch->objs[i]->rsp;
+		if ((cmd->rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
+			switch (cmd->type) {
+			case BATCH_MODEL:
+				exword_parse_model(self, batch->objs[i], cmd->data);
+				break;
+			case BATCH_CAPACITY:
+				exword_parse_capacity(self, batch->objs[i], cmd->data);
+				break;
+			case BATCH_CRYPTKEY:
+				exword_parse_cryptkey(self, batch->objs[i], cmd->data);
+				break;
+			case BATCH_LIST:
+				exword_parse_list(self, batch->objs[i], cmd->data, cmd->count);
+				break;
+			}
+		}
+		obex_object_delete(self->obex_ctx, batch->objs[i]);
+		batch->objs[i] = NULL;
+	}
+	batch->ran = 1;
+	return rsp;
+}
+
+/** @ingroup batch
+ * Returns the response to a command of a batch.
+ * @param batch batch
+ * @param index index returned when the command was added
+ * @return response code, -1 if the command was not sent
+ */
+int exword_batch_response(exword_batch_t *batch, int index)
+{
+	if (index < 0 || index >= batch->count)
+		return -1;
+	return batch->cmds[index].rsp;
+}
+
+/** @ingroup batch
+ * Frees a batch.
+ * Commands that were not run are dropped.
+ * @param batch batch
+ */
+void exword_batch_free(exword_batch_t *batch)
+{
+	int i;
+	if (batch == NULL)
+		return;
+	for (i = 0; i < batch->count; i++) {
+		if (batch->objs[i])
+			obex_object_delete(batch->device->obex_ctx, batch->objs[i]);
+	}
+	free(batch);
+}
+
 /** @ingroup cmd
  * Set userid.
  * This function updates the user_id of connected device.
@@ -796,7 +2341,7 @@ int exword_userid(exword_t *self, exword_userid_t id)
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
 	hv.bs = id.name;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, 17, 0);
-	rsp = obex_request(self->obex_ctx, obj);
+	rsp = exword_request(self, obj);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -812,25 +2357,12 @@ int exword_userid(exword_t *self, exword_userid_t id)
 int exword_cryptkey(exword_t *self, exword_cryptkey_t *key)
 {
 	int rsp;
-	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hv_size;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_GET);
+	obex_object_t *obj = exword_cryptkey_object(self, key);
 	if (obj == NULL)
 		return -1;
-	hv.bs = CryptKey;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 20, 0);
-	hv.bs = key->blk1;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_CRYPTKEY, hv, 28, 0);
-	rsp = obex_request(self->obex_ctx, obj);
-	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
-		while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
-			if (hi == OBEX_HDR_BODY) {
-				memcpy(key->key, hv.bs, 12);
-				break;
-			}
-		}
-	}
+	rsp = exword_request(self, obj);
+	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS)
+		exword_parse_cryptkey(self, obj, key);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -846,28 +2378,11 @@ int exword_cryptkey(exword_t *self, exword_cryptkey_t *key)
 int exword_cname(exword_t *self, char *name, char* dir)
 {
 	int rsp;
-	obex_headerdata_t hv;
-	int dir_length, name_length;
-	char *buffer;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
+	obex_object_t *obj = exword_cname_object(self, name, dir);
 	if (obj == NULL)
 		return -1;
-	dir_length = strlen(dir) + 1;
-	name_length = strlen(name) + 1;
-	buffer = malloc(dir_length + name_length);
-	if (buffer == NULL)
-		return -1;
-	memcpy(buffer, dir, dir_length);
-	memcpy(buffer + dir_length, name, name_length);
-	hv.bs = CName;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 14, 0);
-	hv.bq4 = dir_length + name_length;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
-	hv.bs = buffer;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, dir_length + name_length, 0);
-	rsp = obex_request(self->obex_ctx, obj);
+	rsp = exword_request(self, obj);
 	obex_object_delete(self->obex_ctx, obj);
-	free(buffer);
 	return rsp;
 }
 
@@ -880,17 +2395,10 @@ int exword_cname(exword_t *self, char *name, char* dir)
 int exword_unlock(exword_t *self)
 {
 	int rsp;
-	obex_headerdata_t hv;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
+	obex_object_t *obj = exword_lock_object(self, 0);
 	if (obj == NULL)
 		return -1;
-	hv.bs = Unlock;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 16, 0);
-	hv.bq4 = 1;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
-	hv.bs = "";
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, 1, 0);
-	rsp = obex_request(self->obex_ctx, obj);
+	rsp = exword_request(self, obj);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -904,17 +2412,10 @@ int exword_unlock(exword_t *self)
 int exword_lock(exword_t *self)
 {
 	int rsp;
-	obex_headerdata_t hv;
-	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_PUT);
+	obex_object_t *obj = exword_lock_object(self, 1);
 	if (obj == NULL)
 		return -1;
-	hv.bs = Lock;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 12, 0);
-	hv.bq4 = 1;
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
-	hv.bs = "";
-	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, 1, 0);
-	rsp = obex_request(self->obex_ctx, obj);
+	rsp = exword_request(self, obj);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -939,7 +2440,7 @@ int exword_authchallenge(exword_t *self, exword_authchallenge_t challenge)
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_LENGTH, hv, 0, 0);
 	hv.bs = challenge.challenge;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_BODY, hv, 20, 0);
-	rsp = obex_request(self->obex_ctx, obj);
+	rsp = exword_request(self, obj);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -965,7 +2466,7 @@ int exword_authinfo(exword_t *self, exword_authinfo_t *info)
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_NAME, hv, 20, 0);
 	hv.bs = info->blk1;
 	obex_object_addheader(self->obex_ctx, obj, OBEX_HDR_AUTHINFO, hv, 40, 0);
-	rsp = obex_request(self->obex_ctx, obj);
+	rsp = exword_request(self, obj);
 	if ((rsp & ~OBEX_FINAL) == OBEX_RSP_SUCCESS) {
 		while (obex_object_getnextheader(self->obex_ctx, obj, &hi, &hv, &hv_size)) {
 			if (hi == OBEX_HDR_BODY) {
@@ -990,7 +2491,7 @@ int exword_disconnect(exword_t *self)
 	obex_object_t *obj = obex_object_new(self->obex_ctx, OBEX_CMD_DISCONNECT);
 	if (obj == NULL)
 		return -1;
-	rsp = obex_request(self->obex_ctx, obj);
+	rsp = exword_request(self, obj);
 	obex_object_delete(self->obex_ctx, obj);
 	return rsp;
 }
@@ -1038,6 +2539,8 @@ char *exword_response_to_string(int rsp)
 		return "Database full";
 	case OBEX_RSP_DATABASE_LOCKED:
 		return "Database locked";
+	case LIBUSB_ERROR_INTERRUPTED:
+		return "Cancelled";
 	default:
 		return "Unknown response";
 	}
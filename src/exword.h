@@ -24,6 +24,9 @@
 #include <stdint.h>
 
 typedef struct exword_t exword_t;
+typedef struct exword_async exword_async_t;
+typedef struct exword_batch exword_batch_t;
+typedef struct exword_hotplug exword_hotplug_t;
 
 #define SD_CARD		"\\_SD_00"
 #define INTERNAL_MEM	"\\_INTERNAL_00"
@@ -76,6 +79,23 @@ typedef struct exword_t exword_t;
  *  This mode is used to upload cd audio.
  */
 #define OPEN_CD        0x0200
+/** @ingroup device
+ *  Handle usb events in a library thread.
+ *  Devices opened with this flag share one thread running the usb event
+ *  loop. Completed transfers are handed to the thread using the device
+ *  through a lock free queue, so callbacks still run in the thread that
+ *  calls into the library. Can be combined with any mode.
+ */
+#define OPEN_EVENT_THREAD 0x8000
+
+/** @ingroup hotplug
+ * Device was plugged in
+ */
+#define HOTPLUG_ARRIVED 1
+/** @ingroup hotplug
+ * Device was removed
+ */
+#define HOTPLUG_LEFT    2
 
 /** @ingroup cmd
  * SW capability
@@ -193,6 +213,67 @@ typedef struct {
 } exword_cryptkey_t;
 #pragma pack()
 
+/**
+ * Structure describing an attached device.
+ * Filled in by \ref exword_enumerate and passed to \ref exword_open_device.
+ */
+typedef struct {
+	/** usb bus number */
+	uint8_t bus;
+	/** device address on the bus, changes when the device is plugged in again */
+	uint8_t address;
+	/** number of entries in ports */
+	uint8_t depth;
+	/** port numbers from the root hub to the device */
+	uint8_t ports[7];
+	/** manufacturer string */
+	char manufacturer[32];
+	/** product string */
+	char product[32];
+	/** serial number string, empty if the device has none */
+	char serial[32];
+} exword_device_t;
+
+/**
+ * Structure representing the measured round trip time of the link.
+ * All values are in microseconds.
+ */
+typedef struct {
+	/** smoothed round trip time, 0 until the first packet is answered */
+	int64_t srtt;
+	/** round trip time variation */
+	int64_t rttvar;
+	/** last measured round trip time */
+	int64_t last;
+	/** timeout currently used for usb transfers */
+	int64_t timeout;
+} exword_rtt_t;
+
+/**
+ * Structure representing a file descriptor to watch for device events.
+ */
+typedef struct {
+	/** file descriptor */
+	int fd;
+	/** events to watch for, as in poll() */
+	short events;
+} exword_pollfd_t;
+
+/** @ingroup misc
+ * Called when a file descriptor has to be added to the watched set.
+ * @param fd file descriptor
+ * @param events events to watch for, as in poll()
+ * @param user_data data pointer specified in \ref exword_set_pollfd_notifiers
+ */
+typedef void (*pollfd_added_cb)(int fd, short events, void *user_data);
+
+/** @ingroup misc
+ * Called when a file descriptor no longer has to be watched.
+ * @param fd file descriptor
+ * @param user_data data pointer specified in \ref exword_set_pollfd_notifiers
+ */
+typedef void (*pollfd_removed_cb)(int fd, void *user_data);
+
 /** @ingroup misc
  * File transfer callback function,
  * @param filename name of file currently being transferred
@@ -203,6 +284,51 @@ typedef struct {
  */
 typedef void (*file_cb)(char *filename, uint32_t transferred, uint32_t length, void *user_data);
 
+/** @ingroup cmd
+ * Upload data callback function.
+ * Called by \ref exword_send_stream whenever more file data is needed.
+ * @param buffer destination for the file data
+ * @param length maximum number of bytes to store in buffer
+ * @param user_data data pointer specified in \ref exword_send_stream
+ * @return number of bytes stored, 0 or less on error
+ */
+typedef int (*read_cb)(char *buffer, int length, void *user_data);
+
+/** @ingroup cmd
+ * Download data callback function.
+ * Called by \ref exword_get_stream for each piece of file data received.
+ * @param buffer received file data
+ * @param length number of bytes in buffer
+ * @param user_data data pointer specified in \ref exword_get_stream
+ * @return number of bytes consumed, anything other than length aborts
+ */
+typedef int (*write_cb)(const char *buffer, int length, void *user_data);
+
+/** @ingroup async
+ * Asynchronous command completion callback function.
+ * Called from \ref exword_process_events or \ref exword_async_wait once
+ * the command has finished, failed or was cancelled.
+ * @param handle handle of the finished command
+ * @param rsp response code
+ * @param user_data data pointer specified when queueing the command
+ */
+typedef void (*async_cb)(exword_async_t *handle, int rsp, void *user_data);
+
+/** @ingroup hotplug
+ * Hotplug notification callback function.
+ * Called from \ref exword_hotplug_handle_events when a device arrives or
+ * leaves.
+ * @param hp hotplug manager
+ * @param device device that arrived or left
+ * @param handle connected session of the device if auto connect is on,
+ *        NULL otherwise or if connecting failed. It is owned by the
+ *        manager and closed once the device has left.
+ * @param event \ref HOTPLUG_ARRIVED or \ref HOTPLUG_LEFT
+ * @param user_data data pointer specified in \ref exword_hotplug_new
+ */
+typedef void (*hotplug_cb)(exword_hotplug_t *hp, const exword_device_t *device,
+			   exword_t *handle, int event, void *user_data);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -212,14 +338,62 @@ char * utf16_to_locale(char **dst, int *dstsz, const char *src, int srcsz);
 char * locale_to_utf16(char **dst, int *dstsz, const char *src, int srcsz);
 char * exword_response_to_string(int rsp);
 void exword_set_debug(exword_t *self, int level);
+int exword_set_queue_depth(exword_t *self, int depth);
+void exword_set_read_ahead(exword_t *self, int enable);
+void exword_set_mtu(exword_t *self, uint16_t mtu);
+uint16_t exword_get_mtu(exword_t *self);
+int exword_set_mtu_rx(exword_t *self, uint16_t mtu);
+void exword_get_rtt(exword_t *self, exword_rtt_t *rtt);
+int exword_get_pollfds(exword_t *self, exword_pollfd_t *fds, int max);
+int exword_get_timeout(exword_t *self);
+void exword_set_pollfd_notifiers(exword_t *self, pollfd_added_cb added,
+				 pollfd_removed_cb removed, void *user_data);
+int exword_process_events(exword_t *self);
+exword_async_t * exword_send_file_async(exword_t *self, char* filename, char *buffer, int len,
+				       async_cb cb, void *user_data);
+exword_async_t * exword_get_file_async(exword_t *self, char* filename,
+				      async_cb cb, void *user_data);
+exword_async_t * exword_remove_file_async(exword_t *self, char* filename, int convert_to_unicode,
+					 async_cb cb, void *user_data);
+exword_async_t * exword_setpath_async(exword_t *self, uint8_t *path, uint8_t mkdir,
+				     async_cb cb, void *user_data);
+exword_async_t * exword_list_async(exword_t *self, async_cb cb, void *user_data);
+int exword_async_wait(exword_async_t *handle);
+int exword_async_cancel(exword_async_t *handle);
+int exword_async_done(exword_async_t *handle);
+int exword_async_file(exword_async_t *handle, char **buffer, int *len);
+int exword_async_list(exword_async_t *handle, exword_dirent_t **entries, uint16_t *count);
+void exword_async_free(exword_async_t *handle);
+exword_batch_t * exword_batch_new(exword_t *self);
+int exword_batch_setpath(exword_batch_t *batch, uint8_t *path, uint8_t mkdir);
+int exword_batch_list(exword_batch_t *batch, exword_dirent_t **entries, uint16_t *count);
+int exword_batch_get_model(exword_batch_t *batch, exword_model_t *model);
+int exword_batch_get_capacity(exword_batch_t *batch, exword_capacity_t *cap);
+int exword_batch_cryptkey(exword_batch_t *batch, exword_cryptkey_t *key);
+int exword_batch_cname(exword_batch_t *batch, char *name, char *dir);
+int exword_batch_unlock(exword_batch_t *batch);
+int exword_batch_lock(exword_batch_t *batch);
+int exword_batch_run(exword_batch_t *batch);
+int exword_batch_response(exword_batch_t *batch, int index);
+void exword_batch_free(exword_batch_t *batch);
+int exword_tune_mtu(exword_t *self, uint16_t *mtu);
 void exword_register_callbacks(exword_t *self, file_cb get, file_cb put, void *userdata);
+void exword_cancel(exword_t *self);
 void exword_free_list(exword_dirent_t *entries);
 exword_t * exword_open();
 exword_t * exword_open2(uint16_t options);
+int exword_enumerate(exword_device_t **devices);
+exword_t * exword_open_device(const exword_device_t *device, uint16_t options);
+exword_hotplug_t * exword_hotplug_new(hotplug_cb cb, void *user_data);
+void exword_hotplug_auto_connect(exword_hotplug_t *hp, int enable, uint16_t options);
+int exword_hotplug_handle_events(exword_hotplug_t *hp, int timeout);
+void exword_hotplug_free(exword_hotplug_t *hp);
 void exword_close(exword_t *self);
 int exword_connect(exword_t *self);
 int exword_send_file(exword_t *self, char* filename, char *buffer, int len);
+int exword_send_stream(exword_t *self, char* filename, int len, read_cb read, void *userdata);
 int exword_get_file(exword_t *self, char* filename, char **buffer, int *len);
+int exword_get_stream(exword_t *self, char* filename, write_cb write, void *userdata);
 int exword_remove_file(exword_t *self, char* filename, int convert_to_unicode);
 int exword_get_model(exword_t *self, exword_model_t * model);
 int exword_get_capacity(exword_t *self, exword_capacity_t *cap);
@@ -23,6 +23,8 @@
 #include <string.h>
 #include <locale.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <signal.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -36,6 +38,13 @@ struct state {
 	int running;
 	int connected;
 	int debug;
+	int queue;
+	int read_ahead;
+	int mtu;
+	uint16_t tuned_mtu;
+	char tuned_model[15];	/* model tuned_mtu was measured on */
+	char model[15];
+	int dev_index;
 	int mkdir;
 	int authenticated;
 	int sd_inserted;
@@ -61,6 +70,7 @@ void quit(struct state *s);
 void help(struct state *s);
 void connect(struct state *s);
 void disconnect(struct state *s);
+void devices(struct state *s);
 void set(struct state *s);
 void model(struct state *s);
 void capacity(struct state *s);
@@ -82,6 +92,9 @@ struct command commands[] = {
 	"cd      - connect as CDLoader\n"},
 {"disconnect", disconnect, "disconnect\t\t- disconnect from dictionary\n",
 	"Disconnects from device.\n"},
+{"devices", devices, "devices\t\t\t- list attached dictionaries\n",
+	"Lists attached dictionaries.\n\n"
+	"The number in front of each one selects it with 'set device'.\n"},
 {"model", model, "model\t\t\t- display model information\n",
 	"Displays model information of device.\n"},
 {"capacity", capacity, "capacity\t\t- display medium capacity\n",
@@ -118,6 +131,10 @@ struct command commands[] = {
 	"Sets <option> to [value], if no value is specified will display current value.\n\n"
 	"Available options:\n"
 	"debug <level>  - sets debug level (0-5)\n"
+	"queue <depth>  - sets number of upload packets kept in flight (1-8)\n"
+	"readahead <on|off> - specifies whether responses are read ahead\n"
+	"mtu <size|auto|max> - sets the largest upload packet size\n"
+	"device <number|first> - selects the dictionary connect uses\n"
 	"mkdir <on|off> - specifies whether setpath should create directories\n"},
 {"exit", quit, "exit\t\t\t- exits program\n",
 	"Exits program and disconnects from device.\n"},
@@ -251,15 +268,51 @@ void help(struct state *s)
 	}
 }
 
+static exword_t * open_device(struct state *s, int options)
+{
+	exword_device_t *devs;
+	exword_t *device = NULL;
+	int n;
+	if (s->dev_index < 0)
+		return exword_open2(options);
+	n = exword_enumerate(&devs);
+	if (n > s->dev_index)
+		device = exword_open_device(&devs[s->dev_index], options);
+	free(devs);
+	return device;
+}
+
+/* 'set mtu auto' only uploads the scratch files once per model, later
+ * connects reuse that result unless force is set. */
+static void tune_mtu(struct state *s, int force)
+{
+	uint16_t mtu;
+	if (!force && s->tuned_mtu && s->model[0] != '\0' &&
+	    strcmp(s->tuned_model, s->model) == 0) {
+		exword_set_mtu(s->device, s->tuned_mtu);
+		return;
+	}
+	printf("tuning mtu...");
+	if (exword_tune_mtu(s->device, &mtu) == 0x20) {
+		s->tuned_mtu = mtu;
+		strcpy(s->tuned_model, s->model);
+		printf("%u\n", mtu);
+	} else {
+		printf("failed\n");
+	}
+}
+
 void connect(struct state *s)
 {
 	int  options = OPEN_LIBRARY | LOCALE_JA;
 	char *mode;
 	char *locale;
 	int error = 0;
-	int i;
+	int i, model_idx, path_idx, list_idx;
 	uint16_t count;
 	exword_dirent_t *entries;
+	exword_batch_t *batch;
+	exword_model_t model;
 	if (s->connected)
 		return;
 
@@ -302,28 +355,45 @@ void connect(struct state *s)
 	}
 	if (!error) {
 		printf("connecting to device...");
-		s->device = exword_open2(options);
+		s->device = open_device(s, options);
 		if (s->device == NULL) {
 			printf("device not found\n");
 		} else {
 			exword_set_debug(s->device, s->debug);
+			exword_set_queue_depth(s->device, s->queue);
+			exword_set_read_ahead(s->device, s->read_ahead);
+			if (s->mtu > 0)
+				exword_set_mtu(s->device, s->mtu);
 			if (exword_connect(s->device) != 0x20) {
 				printf("connect failed\n");
 				exword_close(s->device);
 				s->device = NULL;
 			} else {
-				if (exword_setpath(s->device, ROOT, 0) == 0x20) {
-					if (exword_list(s->device, &entries, &count) == 0x20) {
+				s->model[0] = '\0';
+				batch = exword_batch_new(s->device);
+				if (batch != NULL) {
+					model_idx = exword_batch_get_model(batch, &model);
+					path_idx = exword_batch_setpath(batch, ROOT, 0);
+					list_idx = exword_batch_list(batch, &entries, &count);
+					exword_batch_run(batch);
+					if (exword_batch_response(batch, model_idx) == 0x20)
+						strncpy(s->model, model.model, sizeof(s->model) - 1);
+					if (exword_batch_response(batch, path_idx) == 0x20 &&
+					    exword_batch_response(batch, list_idx) == 0x20) {
 						for (i = 0; i < count; i++) {
 							if (strcmp(entries[i].name, "_SD_00") == 0) {
 								s->sd_inserted = 1;
 								break;
 							}
 						}
-						exword_free_list(entries);
 					}
+					if (entries != NULL)
+						exword_free_list(entries);
+					exword_batch_free(batch);
 				}
 				_setpath(s, INTERNAL_MEM, "/", 2);
+				if (s->mtu < 0)
+					tune_mtu(s, 0);
 				s->connected = 1;
 				s->mode = (options & 0xff00);
 				printf("done\n");
@@ -332,6 +402,27 @@ void connect(struct state *s)
 	}
 }
 
+void devices(struct state *s)
+{
+	exword_device_t *devs;
+	int i, j, n;
+	n = exword_enumerate(&devs);
+	if (n < 0) {
+		printf("enumeration failed\n");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		printf("%d: bus %u port ", i, devs[i].bus);
+		for (j = 0; j < devs[i].depth; j++)
+			printf(j ? ".%u" : "%u", devs[i].ports[j]);
+		printf(" %s %s %s\n", devs[i].manufacturer,
+		       devs[i].product, devs[i].serial);
+	}
+	if (n == 0)
+		printf("no devices found\n");
+	free(devs);
+}
+
 void disconnect(struct state *s)
 {
 	if (!s->connected)
@@ -393,10 +484,32 @@ void format(struct state *s)
 	printf("%s\n", exword_response_to_string(rsp));
 }
 
+static exword_t *transfer_device;
+static void (*transfer_old_sigint)(int);
+
+static void transfer_interrupt(int sig)
+{
+	(void) sig;
+	exword_cancel(transfer_device);
+}
+
+/* Let Ctrl-C cancel the transfer instead of killing the program */
+static void transfer_begin(struct state *s)
+{
+	transfer_device = s->device;
+	transfer_old_sigint = signal(SIGINT, transfer_interrupt);
+}
+
+/* Hand Ctrl-C back to whoever had it before, e.g. readline */
+static void transfer_end(void)
+{
+	signal(SIGINT, transfer_old_sigint == SIG_ERR ? SIG_DFL : transfer_old_sigint);
+	transfer_device = NULL;
+}
+
 void send(struct state *s)
 {
-	int rsp, len;
-	char *buffer;
+	int rsp, len, fd;
 	char *filename;
 	char *name = NULL;
 	if (!s->connected)
@@ -408,20 +521,31 @@ void send(struct state *s)
 		name = xmalloc(strlen(filename) + 1);
 		strcpy(name, filename);
 		printf("uploading...");
-		rsp = read_file(name, &buffer, &len);
-		if (rsp == 0x20)
-			rsp = exword_send_file(s->device, basename(name), buffer, len);
+		fd = open_file(name, &len);
+		if (fd < 0) {
+			rsp = 0x44;
+		} else {
+			transfer_begin(s);
+			rsp = exword_send_stream(s->device, basename(name), len, read_fd, &fd);
+			transfer_end();
+			close(fd);
+		}
 		free(name);
-		free(buffer);
 		printf("%s\n", exword_response_to_string(rsp));
 	}
 }
 
+int download_write(const char *buffer, int len, void *user_data)
+{
+	return write_fd(buffer, len, user_data);
+}
+
 void get(struct state *s)
 {
-	int rsp, len;
-	char *buffer = NULL, *name = NULL;
+	int rsp, fd;
+	char *name = NULL;
 	char *filename;
+	char *tmpname;
 	if (!s->connected)
 		return;
 	filename = peek_arg(&(s->cmd_list));
@@ -431,11 +555,23 @@ void get(struct state *s)
 		name = xmalloc(strlen(filename) + 1);
 		strcpy(name, filename);
 		printf("downloading...");
-		rsp = exword_get_file(s->device, basename(name), &buffer, &len);
-		if (rsp == 0x20)
-			rsp = write_file(filename, buffer, len);
+		/* An existing local file is only replaced by a complete download */
+		fd = create_temp_file(filename, &tmpname);
+		if (fd < 0) {
+			rsp = 0x43;
+		} else {
+			transfer_begin(s);
+			rsp = exword_get_stream(s->device, basename(name), download_write, &fd);
+			transfer_end();
+			if (close(fd) < 0 && rsp == 0x20)
+				rsp = 0x50;
+			if (rsp == 0x20 && replace_file(tmpname, filename) < 0)
+				rsp = 0x43;
+			if (rsp != 0x20)
+				unlink(tmpname);
+			free(tmpname);
+		}
 		free(name);
-		free(buffer);
 		printf("%s\n", exword_response_to_string(rsp));
 	}
 }
@@ -667,6 +803,92 @@ void set(struct state *s)
 					exword_set_debug(s->device, s->debug);
 			}
 		}
+	} else if (strcmp(opt, "queue") == 0) {
+		uint8_t queue;
+		dequeue_arg(&(s->cmd_list));
+		arg = peek_arg(&(s->cmd_list));
+		if (arg == NULL) {
+			printf("Queue Depth: %u\n", s->queue);
+		} else {
+			if (sscanf(arg, "%hhu", &queue) < 1) {
+				printf("Invalid value\n");
+			} else if (queue < 1 || queue > 8) {
+				printf("Value should be between 1 and 8\n");
+			} else {
+				s->queue = queue;
+				if (s->connected)
+					exword_set_queue_depth(s->device, s->queue);
+			}
+		}
+	} else if (strcmp(opt, "mtu") == 0) {
+		uint16_t mtu;
+		dequeue_arg(&(s->cmd_list));
+		arg = peek_arg(&(s->cmd_list));
+		if (arg == NULL) {
+			if (s->mtu < 0)
+				printf("MTU: auto\n");
+			else if (s->mtu == 0)
+				printf("MTU: max\n");
+			else
+				printf("MTU: %d\n", s->mtu);
+			if (s->connected)
+				printf("Current MTU: %u\n", exword_get_mtu(s->device));
+		} else if (strcmp(arg, "auto") == 0) {
+			s->mtu = -1;
+			if (s->connected)
+				tune_mtu(s, 1);
+		} else if (strcmp(arg, "max") == 0) {
+			s->mtu = 0;
+			if (s->connected)
+				exword_set_mtu(s->device, 0xffff);
+		} else {
+			if (sscanf(arg, "%hu", &mtu) < 1) {
+				printf("Invalid value\n");
+			} else if (mtu < 255) {
+				printf("Value should be between 255 and 65535\n");
+			} else {
+				s->mtu = mtu;
+				if (s->connected)
+					exword_set_mtu(s->device, s->mtu);
+			}
+		}
+	} else if (strcmp(opt, "device") == 0) {
+		int index;
+		dequeue_arg(&(s->cmd_list));
+		arg = peek_arg(&(s->cmd_list));
+		if (arg == NULL) {
+			if (s->dev_index < 0)
+				printf("Device: first\n");
+			else
+				printf("Device: %d\n", s->dev_index);
+		} else if (strcmp(arg, "first") == 0) {
+			s->dev_index = -1;
+		} else if (sscanf(arg, "%d", &index) < 1 || index < 0) {
+			printf("Invalid value\n");
+		} else {
+			s->dev_index = index;
+		}
+	} else if (strcmp(opt, "readahead") == 0) {
+		dequeue_arg(&(s->cmd_list));
+		arg = peek_arg(&(s->cmd_list));
+		if (arg == NULL) {
+			printf("Readahead: %u\n", s->read_ahead);
+		} else {
+			if (strcmp(arg, "on") == 0 ||
+			    strcmp(arg, "yes") == 0 ||
+			    strcmp(arg, "true") == 0) {
+				s->read_ahead = 1;
+			} else if (strcmp(arg, "off") == 0 ||
+			    strcmp(arg, "no") == 0 ||
+			    strcmp(arg, "false") == 0) {
+				s->read_ahead = 0;
+			} else {
+				printf("Invalid value\n");
+				return;
+			}
+			if (s->connected)
+				exword_set_read_ahead(s->device, s->read_ahead);
+		}
 	} else if (strcmp(opt, "mkdir") == 0) {
 		dequeue_arg(&(s->cmd_list));
 		arg = peek_arg(&(s->cmd_list));
@@ -749,6 +971,8 @@ int main(int argc, const char** argv)
 	struct state s;
 	setlocale(LC_ALL, "");
 	memset(&s, 0, sizeof(struct state));
+	s.queue = 1;
+	s.dev_index = -1;
 	interactive(&s);
 	return 0;
 }
@@ -24,60 +24,435 @@
  *
  */
 #include "obex.h"
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+
+static void obex_write_cb(struct libusb_transfer *transfer);
+static void obex_read_cb(struct libusb_transfer *transfer);
+static void obex_queue_cb(struct libusb_transfer *transfer);
+static void obex_fill_queue(obex_t *self);
+static int obex_rx_views_pin(obex_t *self);
+
+static int obex_transfer_error(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
 
-static int obex_bulk_read(obex_t *self, buf_t *msg)
+static int64_t obex_time_us(void)
 {
-	int retval, actual_length;
-	int expected_length;
-	char * buffer;
-	DEBUG(self, 4, "Read from endpoint %d\n", self->read_endpoint_address);
-	if (msg->data_size > 0 && ntohs(*((uint16_t*)(msg->data + 1))) == msg->data_size)
-		return msg->data_size;
-	do {
-		buffer = buf_reserve_end(msg, self->mtu_rx);
-		retval = libusb_bulk_transfer(self->usb_dev, self->read_endpoint_address, buffer, self->mtu_rx, &actual_length, 1245);
-		buf_remove_end(msg, self->mtu_rx - actual_length);
-		expected_length = ntohs(*((uint16_t*)(msg->data + 1)));
-	} while ((expected_length != msg->data_size && retval == 0) ||
-		 (actual_length == 0 && retval == 0));
-	if (retval == 0)
-		retval = msg->data_size;
-	return retval;
-}
-
-static int obex_bulk_write(obex_t *self, buf_t *msg)
-{
-	int actual_length, retval;
-	DEBUG(self, 4, "Write to endpoint %d\n", self->write_endpoint_address);
-	retval = libusb_bulk_transfer(self->usb_dev, self->write_endpoint_address, msg->data, msg->data_size, &actual_length, 1245);
-	if (retval == 0)
-		retval = actual_length;
-	return retval;
-}
-
-static int obex_verify_seq(obex_t *self, uint8_t seq) {
-	int retval, actual_length = 0, count = 0;
-	char * buffer;
-	buffer = buf_reserve_end(self->rx_msg, self->mtu_rx);
-	do {
-		retval = libusb_bulk_transfer(self->usb_dev, self->read_endpoint_address, buffer, self->mtu_rx, &actual_length, 1245);
-		if (retval < 0)
-			break;
-		count++;
-	} while (count < 100 && actual_length == 0);
-	buf_remove_end(self->rx_msg, self->mtu_rx - actual_length);
-	if (retval < 0 || actual_length == 0) {
-		DEBUG(self, 4, "Error reading seq number (%d)\n",
-		      retval);
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Timeout for a transfer of len bytes submitted now, which may have to
+ * wait for the answers to every packet still outstanding */
+static unsigned int obex_timeout(obex_t *self, size_t len)
+{
+	int pending = self->tx_count > 1 ? self->tx_count : 1;
+	return (self->rto * pending + OBEX_TIMEOUT_PER_BYTE * len + 999) / 1000;
+}
+
+/* Double the RTO after a timeout, the device may just be slow */
+static int obex_backoff(obex_t *self)
+{
+	if (self->rto >= OBEX_RTO_MAX)
 		return 0;
+	self->rto = self->rto * 2 < OBEX_RTO_MAX ? self->rto * 2 : OBEX_RTO_MAX;
+	self->rx_timeouts++;
+	DEBUG(self, 3, "Transfer timed out, rto=%" PRId64 "\n", self->rto);
+	return 1;
+}
+
+static void obex_rtt_sample(obex_t *self, int64_t rtt)
+{
+	int64_t err;
+
+	if (rtt < 0)
+		return;
+	self->rtt = rtt;
+	if (self->srtt == 0) {
+		self->srtt = rtt;
+		self->rttvar = rtt / 2;
+	} else {
+		err = self->srtt - rtt;
+		if (err < 0)
+			err = -err;
+		self->rttvar = (3 * self->rttvar + err) / 4;
+		self->srtt = (7 * self->srtt + rtt) / 8;
+	}
+	/* 1ms is the granularity of libusb timeouts */
+	self->rto = self->srtt + (4 * self->rttvar > 1000 ? 4 * self->rttvar : 1000);
+	if (self->rto < OBEX_RTO_MIN)
+		self->rto = OBEX_RTO_MIN;
+	if (self->rto > OBEX_RTO_MAX)
+		self->rto = OBEX_RTO_MAX;
+	DEBUG(self, 4, "rtt=%" PRId64 " srtt=%" PRId64 " rttvar=%" PRId64 " rto=%" PRId64 "\n",
+	      rtt, self->srtt, self->rttvar, self->rto);
+}
+
+/* Thread handling the events of a usb context shared by every session
+ * opened with OBEX_FL_EVENT_THREAD. It only moves completed transfers to
+ * the ring of their session, the session handles them in its own thread
+ * from obex_request_step. */
+static struct {
+	pthread_mutex_t lock;
+	libusb_context *usb_ctx;
+	pthread_t thread;
+	int users;
+	int stop;
+} obex_events = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void *obex_event_thread(void *arg)
+{
+	struct timeval tv = { 0, 100000 };
+	(void) arg;
+	while (!__atomic_load_n(&obex_events.stop, __ATOMIC_ACQUIRE))
+		libusb_handle_events_timeout_completed(obex_events.usb_ctx, &tv, &obex_events.stop);
+	return NULL;
+}
+
+static libusb_context *obex_events_get(void)
+{
+	libusb_context *ctx = NULL;
+
+	pthread_mutex_lock(&obex_events.lock);
+	if (obex_events.users == 0) {
+		if (libusb_init(&obex_events.usb_ctx) < 0)
+			goto out;
+		obex_events.stop = 0;
+		if (pthread_create(&obex_events.thread, NULL, obex_event_thread, NULL) != 0) {
+			libusb_exit(obex_events.usb_ctx);
+			goto out;
+		}
+	}
+	obex_events.users++;
+	ctx = obex_events.usb_ctx;
+out:
+	pthread_mutex_unlock(&obex_events.lock);
+	return ctx;
+}
+
+static void obex_events_put(void)
+{
+	pthread_mutex_lock(&obex_events.lock);
+	if (--obex_events.users == 0) {
+		__atomic_store_n(&obex_events.stop, 1, __ATOMIC_RELEASE);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(obex_events.usb_ctx);
+#endif
+		pthread_join(obex_events.thread, NULL);
+		libusb_exit(obex_events.usb_ctx);
+		obex_events.usb_ctx = NULL;
 	}
-	if ((uint8_t)buffer[0] != seq) {
-		DEBUG(self, 4, "Sequence mismatch %u != %u\n",
-		      (uint8_t)buffer[0], seq);
+	pthread_mutex_unlock(&obex_events.lock);
+}
+
+/* Producer side of the completion ring. Runs in whichever thread handles
+ * events, libusb only lets one do so at a time. */
+static void obex_queue_cb(struct libusb_transfer *transfer)
+{
+	struct obex_xfer *x = transfer->user_data;
+	obex_t *self = x->context;
+	unsigned int tail = self->cq_tail;
+	ssize_t ret;
+
+	self->cq_ring[tail % OBEX_COMPLETION_RING] = x;
+	__atomic_store_n(&self->cq_tail, tail + 1, __ATOMIC_SEQ_CST);
+	/* Only wake the session if it may have found the ring empty,
+	   completions arriving meanwhile are picked up in the same pass */
+	if (__atomic_load_n(&self->cq_head, __ATOMIC_SEQ_CST) == tail)
+		ret = write(self->cq_wake[1], "", 1);
+	(void) ret;
+}
+
+/* Consumer side, handles every completion queued so far */
+static int obex_dispatch_completions(obex_t *self)
+{
+	struct libusb_transfer *transfer;
+	unsigned int head = self->cq_head;
+	int n = 0;
+
+	while (head != __atomic_load_n(&self->cq_tail, __ATOMIC_SEQ_CST)) {
+		transfer = self->cq_ring[head % OBEX_COMPLETION_RING]->transfer;
+		__atomic_store_n(&self->cq_head, ++head, __ATOMIC_SEQ_CST);
+		if (transfer->endpoint & LIBUSB_ENDPOINT_IN)
+			obex_read_cb(transfer);
+		else
+			obex_write_cb(transfer);
+		n++;
+	}
+	return n;
+}
+
+/* Wait at most tv (forever if NULL) for completions and handle them */
+static int obex_wait_completions(obex_t *self, struct timeval *tv)
+{
+	struct pollfd pfd;
+	char buf[32];
+	int timeout = -1, ret;
+
+	if (obex_dispatch_completions(self) > 0 || self->done)
 		return 0;
+	if (tv != NULL)
+		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+	pfd.fd = self->cq_wake[0];
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, timeout);
+	if (ret < 0)
+		return errno == EINTR ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_IO;
+	while (read(self->cq_wake[0], buf, sizeof(buf)) > 0)
+		;
+	obex_dispatch_completions(self);
+	return 0;
+}
+
+static int obex_xfer_init(obex_t *self, struct obex_xfer *x,
+			  size_t size, size_t headroom)
+{
+	x->context = self;
+	x->busy = 0;
+	if (x->buf == NULL)
+		x->buf = buf_new_headroom(size, headroom);
+	if (x->transfer == NULL)
+		x->transfer = libusb_alloc_transfer(0);
+	if (x->buf == NULL || x->transfer == NULL)
+		return -1;
+	return 0;
+}
+
+static void obex_xfer_free(struct obex_xfer *x)
+{
+	if (x->transfer)
+		libusb_free_transfer(x->transfer);
+	buf_free(x->buf);
+	x->transfer = NULL;
+	x->buf = NULL;
+}
+
+static int obex_bulk_write(obex_t *self, struct obex_xfer *x)
+{
+	int ret;
+	DEBUG(self, 4, "Write to endpoint %d\n", self->write_endpoint_address);
+	libusb_fill_bulk_transfer(x->transfer, self->usb_dev, self->write_endpoint_address,
+				  x->buf->data, x->buf->data_size,
+				  self->event_thread ? obex_queue_cb : obex_write_cb, x,
+				  obex_timeout(self, x->buf->data_size));
+	x->sent = obex_time_us();
+	ret = libusb_submit_transfer(x->transfer);
+	if (ret == 0)
+		x->busy = 1;
+	return ret;
+}
+
+static int obex_bulk_read(obex_t *self)
+{
+	struct obex_xfer *x;
+	int ret;
+	DEBUG(self, 4, "Read from endpoint %d\n", self->read_endpoint_address);
+	x = &self->rx_queue[(self->rx_head + self->rx_count) % OBEX_MAXIMUM_READ_AHEAD];
+	if (obex_xfer_init(self, x, OBEX_MAXIMUM_MTU, 0) < 0)
+		return LIBUSB_ERROR_NO_MEM;
+	libusb_fill_bulk_transfer(x->transfer, self->usb_dev, self->read_endpoint_address,
+				  x->buf->buffer, self->mtu_rx,
+				  self->event_thread ? obex_queue_cb : obex_read_cb, x,
+				  obex_timeout(self, self->mtu_rx));
+	ret = libusb_submit_transfer(x->transfer);
+	if (ret == 0) {
+		x->busy = 1;
+		self->rx_count++;
 	}
-	buf_remove_begin(self->rx_msg, 1);
-	return 1;
+	return ret;
+}
+
+static int obex_post_reads(obex_t *self)
+{
+	struct obex_xfer *x;
+	int i, wanted = 0, ret;
+
+	/* Each packet is answered with its sequence number and a response,
+	   which may or may not arrive in the same transfer */
+	for (i = 0; i < self->tx_count; i++) {
+		x = &self->tx_queue[(self->tx_head + i) % self->queue_depth];
+		wanted += x->acked ? 1 : 2;
+	}
+	if (!self->read_ahead && wanted > 1)
+		wanted = 1;
+	if (wanted > OBEX_MAXIMUM_READ_AHEAD)
+		wanted = OBEX_MAXIMUM_READ_AHEAD;
+
+	while (self->rx_count < wanted) {
+		ret = obex_bulk_read(self);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static void obex_cancel_reads(obex_t *self)
+{
+	int i;
+	for (i = 0; i < OBEX_MAXIMUM_READ_AHEAD; i++) {
+		if (self->rx_queue[i].busy)
+			libusb_cancel_transfer(self->rx_queue[i].transfer);
+	}
+}
+
+static void obex_cancel_transfers(obex_t *self)
+{
+	int i;
+	for (i = 0; i < self->queue_depth; i++) {
+		if (self->tx_queue[i].busy)
+			libusb_cancel_transfer(self->tx_queue[i].transfer);
+	}
+	obex_cancel_reads(self);
+}
+
+static void obex_check_done(obex_t *self)
+{
+	int i;
+	if (!self->stopping || self->tx_count > 0)
+		return;
+	for (i = 0; i < self->queue_depth; i++) {
+		if (self->tx_queue[i].busy)
+			return;
+	}
+	for (i = 0; i < OBEX_MAXIMUM_READ_AHEAD; i++) {
+		if (self->rx_queue[i].busy) {
+			/* A read posted ahead got nothing to answer */
+			obex_cancel_reads(self);
+			return;
+		}
+	}
+	if (obex_rx_views_pin(self) < 0)
+		self->rsp = -1;
+	self->done = 1;
+}
+
+static void obex_request_finish(obex_t *self, int rsp)
+{
+	int i;
+
+	if (!self->stopping)
+		self->rsp = rsp;
+	self->stopping = 1;
+	if (rsp < 0) {
+		/* Outstanding packets will never be answered */
+		for (i = self->batch_rx; i < self->batch_count; i++)
+			self->batch[i]->rsp = rsp;
+		/* but the device may still send what it has */
+		if (self->tx_count > 0 || self->rx_count > 0)
+			self->rx_stale = 1;
+		self->tx_count = 0;
+		self->resync = 0;
+		obex_cancel_transfers(self);
+	}
+	obex_check_done(self);
+}
+
+/* Position of a sent packet in the queue, 0 is the oldest unanswered */
+static int obex_xfer_pos(obex_t *self, struct obex_xfer *x)
+{
+	return (x - self->tx_queue - self->tx_head + self->queue_depth) % self->queue_depth;
+}
+
+/* Send the packets that never reached the device again, in order and
+ * with their original sequence numbers. The packets before them and the
+ * reads for their answers are left alone. */
+static void obex_resync(obex_t *self)
+{
+	struct obex_xfer *x;
+	int i, ret;
+
+	self->resync = 0;
+	if (self->resync_halt) {
+		ret = libusb_clear_halt(self->usb_dev, self->write_endpoint_address);
+		if (ret < 0) {
+			obex_request_finish(self, ret);
+			return;
+		}
+	}
+	/* Karn: the resent packets give no rtt sample */
+	self->rx_timeouts = 1;
+
+	for (i = self->resync_from; i < self->tx_count; i++) {
+		x = &self->tx_queue[(self->tx_head + i) % self->queue_depth];
+		ret = obex_bulk_write(self, x);
+		if (ret < 0) {
+			obex_request_finish(self, ret);
+			return;
+		}
+	}
+	obex_fill_queue(self);
+}
+
+/* A write failed. Only a packet of which nothing went out can be sent
+ * again, together with the packets queued behind it once they have all
+ * come back without reaching the device either. Anything else may have
+ * been acted on and ends the request. */
+static void obex_write_error(obex_t *self, struct obex_xfer *x, int err)
+{
+	struct obex_xfer *y;
+	int pos, i, backoff;
+
+	pos = obex_xfer_pos(self, x);
+	if (self->resync && pos >= self->resync_from) {
+		/* Would reach the device ahead of the packet to resend */
+		if (x->transfer->actual_length > 0) {
+			obex_request_finish(self, err < 0 ? err : LIBUSB_ERROR_IO);
+			return;
+		}
+	} else if (err == 0) {
+		return;
+	} else if (x->transfer->actual_length > 0 || self->stopping ||
+		   err == LIBUSB_ERROR_NO_DEVICE || err == LIBUSB_ERROR_NO_MEM ||
+		   err == LIBUSB_ERROR_INTERRUPTED) {
+		obex_request_finish(self, err);
+		return;
+	} else {
+		/* Timeouts back off like reads do before they count as
+		   retries */
+		backoff = err == LIBUSB_ERROR_TIMEOUT && obex_backoff(self);
+		if (!backoff && ++self->retries > OBEX_MAXIMUM_RETRIES) {
+			obex_request_finish(self, err);
+			return;
+		}
+		DEBUG(self, 1, "Write error %d, resending %d packets\n", err, self->tx_count - pos);
+		self->resync = 1;
+		self->resync_from = pos;
+		self->resync_halt = err == LIBUSB_ERROR_PIPE;
+		for (i = pos + 1; i < self->tx_count; i++) {
+			y = &self->tx_queue[(self->tx_head + i) % self->queue_depth];
+			if (y->busy)
+				libusb_cancel_transfer(y->transfer);
+		}
+	}
+
+	for (i = self->resync_from; i < self->tx_count; i++) {
+		y = &self->tx_queue[(self->tx_head + i) % self->queue_depth];
+		if (y->busy)
+			return;
+	}
+	obex_resync(self);
 }
 
 static int obex_claim_interface(obex_t *ctx)
@@ -128,7 +503,145 @@ done:
 	return ret;
 }
 
-static void free_headerq(struct list_head *list)
+/* Memory for the headers of the objects of a session. It is taken from a
+ * few blocks that are kept and reused, so most requests need no heap
+ * allocation for their headers. Every allocation records its block, which
+ * counts the ones still live and is emptied again when the last goes, no
+ * matter how many other objects are alive. */
+#define OBEX_ARENA_ALIGN	8
+
+static void *obex_arena_alloc(obex_t *self, size_t size)
+{
+	struct obex_arena_block *b, **last;
+	uint8_t *p;
+
+	size = ((size + OBEX_ARENA_ALIGN - 1) & ~(size_t) (OBEX_ARENA_ALIGN - 1)) +
+	       OBEX_ARENA_ALIGN;
+	pthread_mutex_lock(&self->mem_lock);
+	for (last = &self->arena; (b = *last) != NULL; last = &b->next) {
+		if (b->size - b->used >= size)
+			break;
+	}
+	if (b == NULL) {
+		b = malloc(sizeof(struct obex_arena_block) +
+			   (size > OBEX_ARENA_BLOCK ? size : OBEX_ARENA_BLOCK));
+		if (b == NULL) {
+			pthread_mutex_unlock(&self->mem_lock);
+			return NULL;
+		}
+		b->next = NULL;
+		b->size = size > OBEX_ARENA_BLOCK ? size : OBEX_ARENA_BLOCK;
+		b->used = 0;
+		b->live = 0;
+		*last = b;
+	}
+	p = b->data + b->used;
+	*(struct obex_arena_block **) p = b;
+	b->used += size;
+	b->live++;
+	pthread_mutex_unlock(&self->mem_lock);
+	return p + OBEX_ARENA_ALIGN;
+}
+
+static void obex_arena_release(obex_t *self, const void *mem)
+{
+	struct obex_arena_block *b, **pos;
+
+	b = *(struct obex_arena_block **) ((uint8_t *) mem - OBEX_ARENA_ALIGN);
+	pthread_mutex_lock(&self->mem_lock);
+	if (--b->live == 0) {
+		b->used = 0;
+		/* Only the standard blocks are worth keeping */
+		if (b->size > OBEX_ARENA_BLOCK) {
+			for (pos = &self->arena; *pos != b; pos = &(*pos)->next)
+				;
+			*pos = b->next;
+			free(b);
+		}
+	}
+	pthread_mutex_unlock(&self->mem_lock);
+}
+
+static void obex_arena_free(obex_t *self)
+{
+	struct obex_arena_block *b;
+
+	while (self->arena != NULL) {
+		b = self->arena;
+		self->arena = b->next;
+		free(b);
+	}
+}
+
+/* New header element with a buffer for len bytes, or none if len is
+ * negative. Small ones live in the arena. */
+static struct obex_header_element *obex_element_new(obex_t *self, int len)
+{
+	struct obex_header_element *h;
+	uint8_t *mem;
+
+	if (len > OBEX_ARENA_BLOCK / 4) {
+		h = malloc(sizeof(struct obex_header_element));
+		if (h == NULL)
+			return NULL;
+		memset(h, 0, sizeof(struct obex_header_element));
+		h->buf = buf_new(len);
+		if (h->buf == NULL) {
+			free(h);
+			return NULL;
+		}
+		return h;
+	}
+
+	mem = obex_arena_alloc(self, sizeof(struct obex_header_element) +
+			       (len < 0 ? 0 : sizeof(buf_t) + len));
+	if (mem == NULL)
+		return NULL;
+	h = (struct obex_header_element *) mem;
+	memset(h, 0, sizeof(struct obex_header_element));
+	h->arena = 1;
+	if (len >= 0) {
+		h->buf = (buf_t *) (mem + sizeof(struct obex_header_element));
+		buf_init(h->buf, mem + sizeof(struct obex_header_element) + sizeof(buf_t), len);
+	}
+	return h;
+}
+
+/* Header element followed by a copy of value, which data points at.
+ * The header itself is only encoded when it is sent. */
+static struct obex_header_element *obex_element_new_value(obex_t *self,
+				const uint8_t *value, unsigned int size)
+{
+	struct obex_header_element *h;
+	int arena = size <= OBEX_ARENA_BLOCK / 4;
+
+	if (arena)
+		h = obex_arena_alloc(self, sizeof(struct obex_header_element) + size);
+	else
+		h = malloc(sizeof(struct obex_header_element) + size);
+	if (h == NULL)
+		return NULL;
+	memset(h, 0, sizeof(struct obex_header_element));
+	h->arena = arena;
+	if (size > 0)
+		memcpy(h + 1, value, size);
+	h->data = (const uint8_t *) (h + 1);
+	return h;
+}
+
+static void obex_element_free(obex_t *self, struct obex_header_element *h)
+{
+	if (h->pinned)
+		obex_arena_release(self, h->data);
+	if (h->arena) {
+		obex_arena_release(self, h);
+		return;
+	}
+	buf_free(h->buf);
+	free(h);
+}
+
+static void free_headerq(obex_t *self, struct list_head *list)
 {
 	struct obex_header_element *h;
 	struct list_head *pos, *q;
@@ -136,9 +649,71 @@ static void free_headerq(struct list_head *list)
 	list_for_each_safe(pos, q, list){
 		h = list_entry(pos, struct obex_header_element, link);
 		list_del(pos);
-		buf_free(h->buf);
-		free(h);
+		if (h->view) {
+			pthread_mutex_lock(&self->mem_lock);
+			list_del(&h->view_link);
+			pthread_mutex_unlock(&self->mem_lock);
+		}
+		obex_element_free(self, h);
+	}
+}
+
+/* Received headers are parsed in place and point into rx_msg. Copy the
+ * ones still doing so to the arena, before the buffer is changed or the
+ * objects are handed back once the request is done. */
+static int obex_rx_views_pin(obex_t *self)
+{
+	struct obex_header_element *h;
+	uint8_t *copy;
+	int ret = 0;
+
+	while (!list_empty(&self->rx_views)) {
+		h = list_entry(self->rx_views.next, struct obex_header_element, view_link);
+		copy = obex_arena_alloc(self, h->length);
+		if (copy != NULL) {
+			memcpy(copy, h->data, h->length);
+			h->pinned = 1;
+		} else {
+			h->length = 0;
+			ret = -1;
+		}
+		h->data = copy;
+		pthread_mutex_lock(&self->mem_lock);
+		list_del(&h->view_link);
+		h->view = 0;
+		pthread_mutex_unlock(&self->mem_lock);
 	}
+	return ret;
+}
+
+static int obex_body_pull(obex_object_t *object,
+			  struct obex_header_element *h, unsigned int want)
+{
+	unsigned int left;
+	uint8_t *dest;
+	int ret;
+
+	/* Bytes not handed out by the reader yet */
+	left = h->length - sizeof(struct obex_byte_stream_hdr) - h->offset;
+	if (want > h->buf->data_size + left)
+		want = h->buf->data_size + left;
+
+	buf_compact(h->buf);
+	while (h->buf->data_size < want) {
+		left = want - h->buf->data_size;
+		dest = buf_reserve_end(h->buf, left);
+		if (dest == NULL)
+			return -1;
+		ret = h->read((char *) dest, left, h->read_data);
+		if (ret <= 0 || ret > left) {
+			DEBUG(object->context, 1, "Reading body failed (%d)\n", ret);
+			buf_remove_end(h->buf, left);
+			return -1;
+		}
+		buf_remove_end(h->buf, left - ret);
+		h->offset += ret;
+	}
+	return 0;
 }
 
 static int send_body(obex_object_t *object,
@@ -146,44 +721,62 @@ static int send_body(obex_object_t *object,
 		     buf_t *txmsg, unsigned int tx_left)
 {
 	struct obex_byte_stream_hdr *body_txh;
-	unsigned int actual;
+	const uint8_t *data;
+	unsigned int actual, left;
 
 	body_txh = (struct obex_byte_stream_hdr*) buf_reserve_end(txmsg, sizeof(struct obex_byte_stream_hdr));
 
-	if (!h->body_touched) {
-		/* This is the first time we try to send this header
-		   obex_object_addheaders has added a struct_byte_stream_hdr
-		   before the actual body-data. We shall send this in every fragment
-		   so we just remove it for now.*/
-
-		buf_remove_begin(h->buf,  sizeof(struct obex_byte_stream_hdr) );
-		h->body_touched = 1;
+	if (h->buf == NULL) {
+		/* Borrowed body, fragments are taken straight from the
+		   caller's memory */
+		data = h->data + h->offset;
+		left = h->length - sizeof(struct obex_byte_stream_hdr) - h->offset;
+	} else if (h->read) {
+		/* Streamed body, make sure this fragment has been read */
+		if (obex_body_pull(object, h, tx_left - sizeof(struct obex_byte_stream_hdr)) < 0)
+			return -1;
+		data = h->buf->data;
+		left = h->buf->data_size + h->length -
+		       sizeof(struct obex_byte_stream_hdr) - h->offset;
+	} else {
+		if (!h->body_touched) {
+			/* This is the first time we try to send this header
+			   obex_object_addheaders has added a struct_byte_stream_hdr
+			   before the actual body-data. We shall send this in every fragment
+			   so we just remove it for now.*/
+
+			buf_remove_begin(h->buf,  sizeof(struct obex_byte_stream_hdr) );
+			h->body_touched = 1;
+		}
+		data = h->buf->data;
+		left = h->buf->data_size;
 	}
 
-	if (tx_left < ( h->buf->data_size +
+	if (tx_left < ( left +
 			sizeof(struct obex_byte_stream_hdr) ) )	{
 		DEBUG(object->context, 4, "Add BODY header\n");
 		body_txh->hi = OBEX_HDR_BODY;
 		body_txh->hl = htons((uint16_t)tx_left);
 
-		buf_insert_end(txmsg, h->buf->data, tx_left
-				- sizeof(struct obex_byte_stream_hdr) );
+		actual = tx_left - sizeof(struct obex_byte_stream_hdr);
+		buf_insert_end(txmsg, (uint8_t *) data, actual);
 
-		buf_remove_begin(h->buf, tx_left
-				- sizeof(struct obex_byte_stream_hdr) );
+		if (h->buf == NULL)
+			h->offset += actual;
+		else
+			buf_remove_begin(h->buf, actual);
 		/* We have completely filled the tx-buffer */
 		actual = tx_left;
 	} else {
 		DEBUG(object->context, 4, "Add BODY_END header\n");
 
 		body_txh->hi = OBEX_HDR_BODY_END;
-		body_txh->hl = htons((uint16_t) (h->buf->data_size + sizeof(struct obex_byte_stream_hdr)));
-		buf_insert_end(txmsg, h->buf->data, h->buf->data_size);
-		actual = h->buf->data_size;
+		body_txh->hl = htons((uint16_t) (left + sizeof(struct obex_byte_stream_hdr)));
+		buf_insert_end(txmsg, (uint8_t *) data, left);
+		actual = left;
 
 		list_del(&h->link);
-		buf_free(h->buf);
-		free(h);
+		obex_element_free(object->context, h);
 	}
 
 	return actual;
@@ -202,10 +795,36 @@ static int obex_object_receive_body(obex_object_t *object, buf_t *msg, uint8_t h
 		return -1;
 	}
 
+	/* Hand the fragment straight to the sink instead of collecting it */
+	if (object->write) {
+		if (len > 0 && object->write((char *) source, len, object->write_data) != (int) len) {
+			DEBUG(object->context, 1, "Body sink failed\n");
+			return -1;
+		}
+		object->written += len;
+		if (hi == OBEX_HDR_BODY_END)
+			DEBUG(object->context, 4, "Body receive done\n");
+		return 1;
+	}
+
+	if (!object->rx_body && hi == OBEX_HDR_BODY_END) {
+		/* Body in one piece, like the answers to most commands */
+		element = obex_element_new(object->context, len);
+		if (element == NULL)
+			return -1;
+		buf_insert_end(element->buf, source, len);
+		element->length = len;
+		element->hi = OBEX_HDR_BODY;
+		list_add_tail(&element->link, &object->rx_headerq);
+		DEBUG(object->context, 4, "Body receive done\n");
+		return 1;
+	}
+
 	if (!object->rx_body) {
 		int alloclen = OBEX_OBJECT_ALLOCATIONTRESHOLD + len;
 
-		if (object->hinted_body_len)
+		/* The announced length is all the room the body needs */
+		if (object->hinted_body_len >= (int) len)
 			alloclen = object->hinted_body_len;
 
 		DEBUG(object->context, 4, "Allocating new body-buffer. Len=%d\n", alloclen);
@@ -213,13 +832,17 @@ static int obex_object_receive_body(obex_object_t *object, buf_t *msg, uint8_t h
 			return -1;
 	}
 
-	/* Reallocate body buffer if needed */
+	/* Reallocate body buffer if needed. It is doubled, so a body
+	   without a length hint is only copied a few times in total. */
 	if (object->rx_body->data_avail + object->rx_body->tail_avail < (int) len) {
-		int t;
+		size_t t, size;
 		DEBUG(object->context, 4, "Buffer too small. Go realloc\n");
 		t = buf_total_size(object->rx_body);
-		buf_resize(object->rx_body, t + OBEX_OBJECT_ALLOCATIONTRESHOLD + len);
-		if (buf_total_size(object->rx_body) != t + OBEX_OBJECT_ALLOCATIONTRESHOLD + len) {
+		size = t + OBEX_OBJECT_ALLOCATIONTRESHOLD + len;
+		if (size < 2 * t)
+			size = 2 * t;
+		buf_resize(object->rx_body, size);
+		if (buf_total_size(object->rx_body) != size) {
 			DEBUG(object->context, 1, "Can't realloc rx_body\n");
 			return -1;
 		}
@@ -229,6 +852,11 @@ static int obex_object_receive_body(obex_object_t *object, buf_t *msg, uint8_t h
 
 	if (hi == OBEX_HDR_BODY_END) {
 		DEBUG(object->context, 4, "Body receive done\n");
+		/* Give back what doubling left unused */
+		if (buf_total_size(object->rx_body) - object->rx_body->data_size >
+		    OBEX_OBJECT_ALLOCATIONTRESHOLD)
+			buf_resize(object->rx_body, object->rx_body->head_avail +
+				   object->rx_body->data_size);
 		if ( (element = malloc(sizeof(struct obex_header_element)) ) ) {
 			memset(element, 0, sizeof(struct obex_header_element));
 			element->length = object->rx_body->data_size;
@@ -247,28 +875,61 @@ static int obex_object_receive_body(obex_object_t *object, buf_t *msg, uint8_t h
 	return 1;
 }
 
+/* Write a queued non-body header at the end of the packet */
+static void obex_header_encode(buf_t *txmsg, struct obex_header_element *h)
+{
+	switch (h->hi & OBEX_HDR_TYPE_MASK) {
+	case OBEX_HDR_TYPE_UINT32: {
+		struct obex_uint_hdr *hdr;
+
+		hdr = (struct obex_uint_hdr *) buf_reserve_end(txmsg, sizeof(struct obex_uint_hdr));
+		hdr->hi = h->hi;
+		hdr->hv = htonl(h->value);
+		break;
+	}
+	case OBEX_HDR_TYPE_UINT8: {
+		struct obex_ubyte_hdr *hdr;
+
+		hdr = (struct obex_ubyte_hdr *) buf_reserve_end(txmsg, sizeof(struct obex_ubyte_hdr));
+		hdr->hi = h->hi;
+		hdr->hv = (uint8_t) h->value;
+		break;
+	}
+	default: {
+		struct obex_unicode_hdr *hdr;
+
+		hdr = (struct obex_unicode_hdr *) buf_reserve_end(txmsg, h->length);
+		hdr->hi = h->hi;
+		hdr->hl = htons((uint16_t) h->length);
+		memcpy(hdr->hv, h->data, h->length - sizeof(struct obex_unicode_hdr));
+		break;
+	}
+	}
+}
+
 static int obex_object_send(obex_t *self, obex_object_t *object)
 {
 	struct obex_header_element *h;
 	struct obex_common_hdr *hdr;
 	buf_t *txmsg;
-	int actual, finished = 0;
+	int ret, finished = 0;
 	uint16_t tx_left;
 	int addmore = 1;
 	int real_opcode;
-	char check[1];
+	struct obex_xfer *x;
 
+	x = &self->tx_queue[(self->tx_head + self->tx_count) % self->queue_depth];
 	tx_left = self->mtu_tx - sizeof(struct obex_common_hdr);
-	/* Reuse transmit buffer */
-	txmsg = buf_reuse(self->tx_msg);
+	/* Reuse transmit buffer of this queue slot */
+	txmsg = buf_reuse(x->buf);
 
 	/* Add nonheader-data first if any (SETPATH, CONNECT)*/
-	if (object->tx_nonhdr_data) {
+	if (object->tx_nonhdr_data && object->tx_nonhdr_data->data_size > 0) {
 		DEBUG(self, 4, "Adding %d bytes of non-headerdata\n", object->tx_nonhdr_data->data_size);
 		buf_insert_end(txmsg, object->tx_nonhdr_data->data, object->tx_nonhdr_data->data_size);
 
-		buf_free(object->tx_nonhdr_data);
-		object->tx_nonhdr_data = NULL;
+		/* Only the first packet carries it, keep the buffer for reuse */
+		buf_reuse(object->tx_nonhdr_data);
 	}
 
 	/* Take headers from the tx queue and try to stuff as
@@ -280,19 +941,23 @@ static int obex_object_send(obex_t *self, obex_object_t *object)
 
 		if (h->hi == OBEX_HDR_BODY) {
 			/* The body may be fragmented over several packets. */
-			tx_left -= send_body(object, h, txmsg, tx_left);
+			if (tx_left <= sizeof(struct obex_byte_stream_hdr))
+				break;
+			ret = send_body(object, h, txmsg, tx_left);
+			if (ret < 0)
+				return ret;
+			tx_left -= ret;
 		} else if(h->hi == OBEX_HDR_EMPTY) {
 			list_del(&h->link);
-			free(h);
+			obex_element_free(self, h);
 		} else if (h->length <= tx_left) {
 			/* There is room for more data in tx msg */
 			DEBUG(self, 4, "Adding non-body header\n");
-			buf_insert_end(txmsg, h->buf->data, h->length);
+			obex_header_encode(txmsg, h);
 			tx_left -= h->length;
 			/* Remove from tx-queue */
 			list_del(&h->link);
-			buf_free(h->buf);
-			free(h);
+			obex_element_free(self, h);
 		} else if (h->length > self->mtu_tx) {
 			/* Header is bigger than MTU. This should not happen,
 			   because OBEX_ObjectAddHeader() rejects headers
@@ -331,18 +996,59 @@ static int obex_object_send(obex_t *self, obex_object_t *object)
 	DUMPBUFFER(self, "Tx", txmsg);
 	DEBUG(self, 1, "len = %d bytes\n", txmsg->data_size);
 
-	actual = obex_bulk_write(self, txmsg);
-	if (actual < 0) {
-		return actual;
-	} else {
-		if (!obex_verify_seq(self, hdr->seq))
-			return -1;
-		return finished;
+	x->object = object;
+	x->seq = hdr->seq;
+	x->finished = finished;
+	x->abort = 0;
+	/* Only PUT and SETPATH packets have a predictable response and can
+	   be followed by more packets before they are answered */
+	x->gate = object->opcode != OBEX_CMD_PUT && object->opcode != OBEX_CMD_SETPATH;
+	x->acked = 0;
+	ret = obex_bulk_write(self, x);
+	if (ret < 0)
+		return ret;
+	self->tx_count++;
 
+	/* Read the next fragment of a streamed body while this packet
+	   is on the wire */
+	if (!list_empty(&object->tx_headerq)) {
+		h = list_entry(object->tx_headerq.next, struct obex_header_element, link);
+		if (h->hi == OBEX_HDR_BODY && h->read)
+			obex_body_pull(object, h, self->mtu_tx - sizeof(struct obex_common_hdr) -
+				       sizeof(struct obex_byte_stream_hdr));
 	}
+	return finished;
+}
+
+/* Send an ABORT packet ending the request in progress */
+static int obex_send_abort(obex_t *self)
+{
+	struct obex_common_hdr *hdr;
+	struct obex_xfer *x;
+	int ret;
+
+	x = &self->tx_queue[(self->tx_head + self->tx_count) % self->queue_depth];
+	buf_reuse(x->buf);
+	hdr = (struct obex_common_hdr *) buf_reserve_begin(x->buf, sizeof(struct obex_common_hdr));
+	hdr->seq = self->seq_num++;
+	hdr->opcode = OBEX_CMD_ABORT | OBEX_FINAL;
+	hdr->len = htons((uint16_t)x->buf->data_size - 1);
+	DEBUG(self, 2, "Sending abort\n");
+
+	x->object = self->object;
+	x->seq = hdr->seq;
+	x->finished = 1;
+	x->abort = 1;
+	x->gate = 1;
+	x->acked = 0;
+	ret = obex_bulk_write(self, x);
+	if (ret < 0)
+		return ret;
+	self->tx_count++;
+	return 1;
 }
 
-int obex_object_receive(obex_t *self, obex_object_t *object)
+static int obex_object_receive(obex_t *self, obex_object_t *object)
 {
 	struct obex_rsp_hdr *hdr;
 	struct obex_header_element *element;
@@ -350,35 +1056,29 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 	struct obex_unicode_hdr *unicode;
 	struct obex_uint_hdr *uint;
 	buf_t *msg;
-	int ret;
 	int length;
 	int version, mtu;
 	uint8_t *source = NULL;
 	unsigned int len, hlen;
-	uint8_t hi;
+	unsigned int leftover;
+	uint8_t hi, rsp;
 	int err = 0;
 
 	msg = self->rx_msg;
-	ret = obex_bulk_read(self, msg);
-	if (ret < 0) {
-		return ret;
-	}
-
 	hdr = (struct obex_rsp_hdr *) msg->data;
-	/* New data has been inserted at the end of message */
-	DEBUG(self, 4, "Got %d bytes msg len=%d\n", ret, msg->data_size);
+	DEBUG(self, 4, "Got %d bytes msg len=%d\n", msg->data_size, ntohs(hdr->len));
 
 	/*
-	 * Make sure that the buffer we have, actually has the specified
-	 * number of bytes. If not the frame may have been fragmented, and
-	 * we will then need to read more from the socket.  
+	 * The caller makes sure that the buffer holds the whole response.
+	 * Anything after it belongs to the next response and is left alone.
 	 */
 	length = ntohs(hdr->len);
-	/* Make sure we have a whole packet. Should not happen due to reading the entire MTU in*/
-	if (length > msg->data_size) {
-		DEBUG(self, 3, "Need more data, size=%d, len=%d!\n", length, msg->data_size);
-		return msg->data_size;
+	if (length < sizeof(struct obex_rsp_hdr) || length > msg->data_size) {
+		DEBUG(self, 1, "Malformed response received\n");
+		return -1;
 	}
+	leftover = msg->data_size - length;
+	rsp = hdr->rsp;
 	DUMPBUFFER(self, "Rx", msg);
 	/* Response of a CMD_CONNECT needs some special treatment.*/
 	if (object->opcode == OBEX_CMD_CONNECT) {
@@ -391,9 +1091,10 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 
 				DEBUG(self, 1, "version=%02x\n", version);
 
-				/* Limit to some reasonable value (usually OBEX_DEFAULT_MTU) */
-				self->mtu_rx = OBEX_DEFAULT_MTU;
-				self->mtu_tx = 0x4006;
+				if (mtu < OBEX_MINIMUM_MTU)
+					mtu = OBEX_MINIMUM_MTU;
+				self->mtu_tx_peer = mtu;
+				self->mtu_tx = mtu < self->mtu_tx_max ? mtu : self->mtu_tx_max;
 
 				DEBUG(self, 1, "requested MTU=%02x, used MTU=%02x\n", mtu, self->mtu_tx);
 			} else {
@@ -406,7 +1107,8 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 	/* So does CMD_DISCONNECT */
 	if (object->opcode == OBEX_CMD_DISCONNECT) {
 		DEBUG(self, 2, "CMD_DISCONNECT done. Resetting MTU!\n");
-		self->mtu_rx = self->mtu_tx = OBEX_DEFAULT_MTU;
+		self->mtu_tx = OBEX_DEFAULT_MTU;
+		self->mtu_tx_peer = 0;
 	}
 
 	/* Remove command from buffer */
@@ -414,16 +1116,18 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 
 	/* Copy any non-header data (like in CONNECT and SETPATH) */
 	if (object->headeroffset) {
-		object->rx_nonhdr_data = buf_new(object->headeroffset);
+		if (object->rx_nonhdr_data == NULL)
+			object->rx_nonhdr_data = buf_new(object->headeroffset);
 		if (!object->rx_nonhdr_data)
 			return -1;
+		buf_reuse(object->rx_nonhdr_data);
 		buf_insert_end(object->rx_nonhdr_data, msg->data, object->headeroffset);
 		DEBUG(self, 4, "Command has %d bytes non-headerdata\n", object->rx_nonhdr_data->data_size);
 		buf_remove_begin(msg, object->headeroffset);
 		object->headeroffset = 0;
 	}
 
-	while ((msg->data_size > 0) && (!err)) {
+	while ((msg->data_size > leftover) && (!err)) {
 		hi = msg->data[0];
 		DEBUG(self, 4, "Header: %02x\n", hi);
 		switch (hi & OBEX_HDR_TYPE_MASK) {
@@ -431,8 +1135,21 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 		case OBEX_HDR_TYPE_UNICODE:
 			unicode = (struct obex_unicode_hdr *) msg->data;
 			source = &msg->data[3];
-			hlen = ntohs(unicode->hl);
-			len = hlen - 3;
+			hlen = sizeof(struct obex_unicode_hdr);
+			if (msg->data_size - leftover >= hlen)
+				hlen = ntohs(unicode->hl);
+			/* The length covers the header itself and must stay
+			   within this response */
+			if (hlen < sizeof(struct obex_unicode_hdr) ||
+			    hlen > msg->data_size - leftover) {
+				DEBUG(self, 1, "Badly formed header received\n");
+				source = NULL;
+				hlen = 0;
+				len = 0;
+				err = -1;
+				break;
+			}
+			len = hlen - sizeof(struct obex_unicode_hdr);
 			if (hi == OBEX_HDR_BODY || hi == OBEX_HDR_BODY_END) {
 				/* The body-header need special treatment */
 				if (obex_object_receive_body(object, msg, hi, source, len) < 0)
@@ -463,7 +1180,7 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 		}
 
 		/* Make sure that the msg is big enough for header */
-		if (len > msg->data_size) {
+		if (hlen > msg->data_size - leftover) {
 			DEBUG(self, 1, "Header %d to big. HSize=%d Buffer=%d\n",
 					hi, len, msg->data_size);
 			source = NULL;
@@ -471,40 +1188,35 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 		}
 
 		if (source) {
-			/* The length MAY be useful when receiving body. */
-			if (hi == OBEX_HDR_LENGTH) {
-				uint = (struct obex_uint_hdr *) msg->data;
-				object->hinted_body_len = ntohl(uint->hv);
-				DEBUG(self, 4, "Hinted body len is %d\n",
-							object->hinted_body_len);
-			}
-
-			if ( (element = malloc(sizeof(struct obex_header_element)) ) ) {
-				memset(element, 0, sizeof(struct obex_header_element));
+			if ( (element = obex_element_new(self, -1)) ) {
 				element->length = len;
 				element->hi = hi;
-
-				/* If we get an emtpy we have to deal with it...
-				 * This might not be an optimal way, but it works. */
-				if (len == 0) {
-					DEBUG(self, 4, "Got empty header. Allocating dummy buffer anyway\n");
-					element->buf = buf_new(1);
+				if ((hi & OBEX_HDR_TYPE_MASK) == OBEX_HDR_TYPE_UINT32) {
+					uint = (struct obex_uint_hdr *) msg->data;
+					element->value = ntohl(uint->hv);
+				} else if ((hi & OBEX_HDR_TYPE_MASK) == OBEX_HDR_TYPE_UINT8) {
+					element->value = source[0];
+				} else if (source + len > msg->data + msg->data_size - leftover) {
+					/* A view may not reach into the next response */
+					DEBUG(self, 1, "Header %d runs past response\n", hi);
+					obex_element_free(self, element);
+					return -1;
 				} else {
-					element->buf = buf_new(len);
-					if (element->buf) {
-						DEBUG(self, 4, "Copying %d bytes\n", len);
-						buf_insert_end(element->buf, source, len);
-					}
+					/* Left in rx_msg until it is reused */
+					element->data = source;
+					element->view = 1;
+					pthread_mutex_lock(&self->mem_lock);
+					list_add_tail(&element->view_link, &self->rx_views);
+					pthread_mutex_unlock(&self->mem_lock);
 				}
-
-				if (element->buf) {
-					/* Add element to rx-list */
-					list_add_tail(&element->link, &object->rx_headerq);
-				} else{
-					DEBUG(self, 1, "Cannot allocate memory\n");
-					free(element);
-					err = -1;
+				/* The length MAY be useful when receiving body. */
+				if (hi == OBEX_HDR_LENGTH) {
+					object->hinted_body_len = element->value;
+					DEBUG(self, 4, "Hinted body len is %d\n",
+								object->hinted_body_len);
 				}
+				/* Add element to rx-list */
+				list_add_tail(&element->link, &object->rx_headerq);
 			} else {
 				DEBUG(self, 1, "Cannot allocate memory\n");
 				err = -1;
@@ -517,24 +1229,314 @@ int obex_object_receive(obex_t *self, obex_object_t *object)
 		DEBUG(self, 4, "Pulling %d bytes\n", hlen);
 		buf_remove_begin(msg, hlen);
 	}
-	return hdr->rsp & ~OBEX_FINAL;
+	return rsp & ~OBEX_FINAL;
+}
+
+/* Send packets until the queue is full. Once the final packet of a
+ * request is out the next request of the batch follows, so the device
+ * receives them back to back. */
+static void obex_fill_queue(obex_t *self)
+{
+	struct obex_xfer *last;
+	int ret;
+
+	/* New packets would overtake the ones to resend, and their answers
+	   would be thrown away with those of a failed request */
+	while (!self->stopping && !self->resync && !self->draining &&
+	       self->tx_count < self->queue_depth) {
+		if (self->tx_count > 0) {
+			last = &self->tx_queue[(self->tx_head + self->tx_count - 1) % self->queue_depth];
+			if (last->gate)
+				break;
+		}
+		if (self->abort) {
+			/* Let the device answer what it already has first */
+			if (self->tx_count > 0)
+				break;
+			if (self->tx_finished) {
+				/* Between two requests, the rest is just dropped */
+				obex_request_finish(self, LIBUSB_ERROR_INTERRUPTED);
+				return;
+			}
+			ret = obex_send_abort(self);
+			if (ret < 0) {
+				obex_request_finish(self, ret);
+				return;
+			}
+			self->tx_finished = 1;
+			break;
+		}
+		if (self->tx_finished) {
+			if (self->batch_tx + 1 >= self->batch_count)
+				break;
+			self->object = self->batch[++self->batch_tx];
+			self->tx_finished = 0;
+		}
+		ret = obex_object_send(self, self->object);
+		if (ret < 0) {
+			obex_request_finish(self, ret);
+			return;
+		}
+		self->tx_finished = ret;
+	}
+
+	ret = obex_post_reads(self);
+	if (ret < 0)
+		obex_request_finish(self, ret);
+}
+
+/* The first response of a batch other than SUCCESS, or SUCCESS */
+static int obex_batch_result(obex_t *self)
+{
+	int i;
+	for (i = 0; i < self->batch_count - 1; i++) {
+		if (self->batch[i]->rsp != OBEX_RSP_SUCCESS)
+			break;
+	}
+	return self->batch[i]->rsp;
+}
+
+static void obex_process_input(obex_t *self)
+{
+	struct obex_rsp_hdr *hdr;
+	struct obex_xfer *x;
+	buf_t *msg = self->rx_msg;
+	int rsp;
+
+	while (self->tx_count > 0) {
+		x = &self->tx_queue[self->tx_head];
+		/* The packet buffer is still owned by libusb */
+		if (x->busy)
+			return;
+		if (!x->acked) {
+			if (msg->data_size < 1)
+				break;
+			if (msg->data[0] != x->seq) {
+				if ((uint8_t) (x->seq - msg->data[0]) > OBEX_MAXIMUM_QUEUE_DEPTH) {
+					DEBUG(self, 4, "Sequence mismatch %u != %u\n",
+					      msg->data[0], x->seq);
+					obex_request_finish(self, -1);
+					return;
+				}
+				/* A packet answered already was answered again,
+				   the answer for this one follows */
+				hdr = (struct obex_rsp_hdr *) (msg->data + 1);
+				if (msg->data_size < 1 + sizeof(struct obex_rsp_hdr) ||
+				    1 + ntohs(hdr->len) > msg->data_size)
+					break;
+				DEBUG(self, 3, "Discarded repeated answer to %u\n", msg->data[0]);
+				buf_remove_begin(msg, 1 + ntohs(hdr->len));
+				continue;
+			}
+			buf_remove_begin(msg, 1);
+			x->acked = 1;
+		}
+
+		hdr = (struct obex_rsp_hdr *) msg->data;
+		if (msg->data_size < sizeof(struct obex_rsp_hdr) ||
+		    ntohs(hdr->len) > msg->data_size) {
+			DEBUG(self, 3, "Need more data, size=%d\n", msg->data_size);
+			break;
+		}
+
+		/* Karn: a response that needed a retried read is no sample */
+		if (self->rx_timeouts == 0)
+			obex_rtt_sample(self, obex_time_us() - x->sent);
+		self->rx_timeouts = 0;
+
+		if (x->abort) {
+			buf_remove_begin(msg, ntohs(hdr->len));
+			self->tx_head = (self->tx_head + 1) % self->queue_depth;
+			self->tx_count--;
+			DEBUG(self, 2, "Abort answered with %02x\n", hdr->rsp);
+			obex_request_finish(self, LIBUSB_ERROR_INTERRUPTED);
+			continue;
+		}
+
+		/* Callbacks inspect the packet this response belongs to */
+		self->tx_msg = x->buf;
+		rsp = obex_object_receive(self, x->object);
+		if (self->callback)
+			self->callback(self, x->object, self->cb_userdata);
+		self->tx_head = (self->tx_head + 1) % self->queue_depth;
+		self->tx_count--;
+
+		if (rsp < 0) {
+			x->object->rsp = rsp;
+			obex_request_finish(self, rsp);
+			return;
+		}
+		if (rsp == OBEX_RSP_CONTINUE) {
+			/* Server wants another final packet (GET) */
+			if (x->finished)
+				self->tx_finished = 0;
+		} else if (!self->stopping) {
+			x->object->rsp = rsp;
+			if (!x->finished) {
+				/* Refused before all of it was sent, so
+				   nothing behind it was sent either */
+				obex_request_finish(self, rsp);
+			} else if (++self->batch_rx == self->batch_count) {
+				obex_request_finish(self, obex_batch_result(self));
+			}
+		}
+	}
+	if (msg->data_size == 0) {
+		buf_reuse(msg);
+	} else {
+		if (obex_rx_views_pin(self) < 0) {
+			obex_request_finish(self, LIBUSB_ERROR_NO_MEM);
+			return;
+		}
+		buf_compact(msg);
+	}
+	obex_fill_queue(self);
+	obex_check_done(self);
 }
 
-obex_t * obex_init(uint16_t vid, uint16_t pid)
+static void obex_write_cb(struct libusb_transfer *transfer)
+{
+	struct obex_xfer *x = transfer->user_data;
+	obex_t *self = x->context;
+	int ret;
+
+	x->busy = 0;
+	ret = obex_transfer_error(transfer);
+	if (ret == 0 && transfer->actual_length != transfer->length)
+		ret = LIBUSB_ERROR_IO;
+	if (ret < 0 || self->resync) {
+		DEBUG(self, 4, "Error writing packet (%d)\n", ret);
+		obex_write_error(self, x, ret);
+		if (ret < 0 || self->stopping)
+			return;
+	}
+	obex_process_input(self);
+}
+
+/* Answers to the packets of a failed request may still arrive. They
+ * are read and thrown away before the next request sends anything,
+ * until a read comes back empty. */
+static void obex_drain(obex_t *self, struct libusb_transfer *transfer, int err)
+{
+	if (err == LIBUSB_ERROR_NO_DEVICE) {
+		self->draining = 0;
+		obex_request_finish(self, err);
+		return;
+	}
+	if (err == 0 && transfer->actual_length > 0 && --self->draining > 0) {
+		DEBUG(self, 3, "Discarded %d bytes\n", transfer->actual_length);
+		if (obex_bulk_read(self) == 0)
+			return;
+	}
+	self->draining = 0;
+	obex_fill_queue(self);
+	obex_check_done(self);
+}
+
+static void obex_read_cb(struct libusb_transfer *transfer)
+{
+	struct obex_xfer *x = transfer->user_data;
+	obex_t *self = x->context;
+	int ret;
+
+	x->busy = 0;
+	/* Consume completed reads in the order they were posted */
+	while (self->rx_count > 0) {
+		x = &self->rx_queue[self->rx_head];
+		if (x->busy)
+			break;
+		self->rx_head = (self->rx_head + 1) % OBEX_MAXIMUM_READ_AHEAD;
+		self->rx_count--;
+
+		transfer = x->transfer;
+		ret = obex_transfer_error(transfer);
+		if (self->draining) {
+			obex_drain(self, transfer, ret);
+			return;
+		}
+		/* Back off and read again */
+		if (ret == LIBUSB_ERROR_TIMEOUT && obex_backoff(self))
+			ret = 0;
+		if (ret < 0) {
+			DEBUG(self, 4, "Error reading response (%d)\n", ret);
+			obex_request_finish(self, ret);
+			return;
+		}
+		if (transfer->actual_length == 0) {
+			if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+				continue;
+			if (++self->rx_empty >= 100) {
+				obex_request_finish(self, -1);
+				return;
+			}
+		} else {
+			self->rx_empty = 0;
+			if (obex_rx_views_pin(self) < 0) {
+				obex_request_finish(self, LIBUSB_ERROR_NO_MEM);
+				return;
+			}
+			buf_insert_end(self->rx_msg, transfer->buffer, transfer->actual_length);
+		}
+	}
+	obex_process_input(self);
+}
+
+/* Get a usb context for a session created with the same flags. With
+ * OBEX_FL_EVENT_THREAD every session shares the context of the event
+ * thread, otherwise each session drives its own. */
+libusb_context * obex_usb_init(int flags)
+{
+	libusb_context *ctx;
+
+	if (flags & OBEX_FL_EVENT_THREAD)
+		return obex_events_get();
+	if (libusb_init(&ctx) < 0)
+		return NULL;
+	return ctx;
+}
+
+void obex_usb_exit(libusb_context *ctx, int flags)
+{
+	if (flags & OBEX_FL_EVENT_THREAD)
+		obex_events_put();
+	else
+		libusb_exit(ctx);
+}
+
+static void obex_object_free(obex_object_t *object)
+{
+	buf_free(object->tx_nonhdr_data);
+	buf_free(object->rx_nonhdr_data);
+	free(object);
+}
+
+/* Create a session on an opened device. Once created, the session owns
+ * dev and the context from obex_usb_init and releases them in
+ * obex_cleanup. On failure both are left to the caller. */
+obex_t * obex_init(libusb_context *ctx, libusb_device_handle *dev, int flags)
 {
 	obex_t *self;
-	int size;
+	int i;
 	self = malloc(sizeof(obex_t));
 	if (self == NULL)
 		return NULL;
 	memset(self, 0, sizeof(obex_t));
-
-	if (libusb_init(&self->usb_ctx) < 0)
-		goto out_err;
-
-	self->usb_dev = libusb_open_device_with_vid_pid(self->usb_ctx, vid, pid);
-	if (self->usb_dev == NULL)
-		goto out_err;
+	self->usb_ctx = ctx;
+	self->usb_dev = dev;
+	self->event_thread = (flags & OBEX_FL_EVENT_THREAD) != 0;
+	self->cq_wake[0] = self->cq_wake[1] = -1;
+	pthread_mutex_init(&self->mem_lock, NULL);
+	INIT_LIST_HEAD(&self->object_pool);
+	INIT_LIST_HEAD(&self->rx_views);
+
+	if (self->event_thread) {
+		if (pipe(self->cq_wake) < 0)
+			goto out_err;
+		fcntl(self->cq_wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(self->cq_wake[1], F_SETFL, O_NONBLOCK);
+		self->cq_pollfd.fd = self->cq_wake[0];
+		self->cq_pollfd.events = POLLIN;
+	}
 
 	if (obex_claim_interface(self) < 0)
 		goto out_err;
@@ -543,45 +1545,67 @@ obex_t * obex_init(uint16_t vid, uint16_t pid)
 	self->debug = 0;
 	self->version = OBEX_VERSION;
 	self->locale = 0x00;
-	self->mtu_rx = OBEX_DEFAULT_MTU;
+	self->mtu_rx = OBEX_DEFAULT_RX_MTU;
 	self->mtu_tx = OBEX_DEFAULT_MTU;
 	self->mtu_tx_max = OBEX_MAXIMUM_MTU;
+	self->rto = OBEX_RTO_INITIAL;
 
 	self->rx_msg = buf_new(self->mtu_rx);
 	if (self->rx_msg == NULL)
 		goto out_err;
 
-	self->tx_msg = buf_new(self->mtu_tx_max);
-	if (self->tx_msg == NULL)
+	if (obex_xfer_init(self, &self->rx_queue[0], OBEX_MAXIMUM_MTU, 0) < 0)
+		goto out_err;
+
+	if (obex_set_queue_depth(self, OBEX_DEFAULT_QUEUE_DEPTH) < 0)
 		goto out_err;
+	self->tx_msg = self->tx_queue[0].buf;
 
 	return self;
 
 out_err:
-	if (self->tx_msg != NULL)
-		buf_free(self->tx_msg);
+	for (i = 0; i < OBEX_MAXIMUM_QUEUE_DEPTH; i++)
+		obex_xfer_free(&self->tx_queue[i]);
+	for (i = 0; i < OBEX_MAXIMUM_READ_AHEAD; i++)
+		obex_xfer_free(&self->rx_queue[i]);
 	if (self->rx_msg != NULL)
 		buf_free(self->rx_msg);
-	if (self->usb_dev)
-		libusb_close(self->usb_dev);
-	if (self->usb_ctx)
-		libusb_exit(self->usb_ctx);
+	if (self->cq_wake[0] >= 0) {
+		close(self->cq_wake[0]);
+		close(self->cq_wake[1]);
+	}
+	pthread_mutex_destroy(&self->mem_lock);
 	free(self);
 	return NULL;
 }
 
 void obex_cleanup(obex_t *self)
 {
+	int i;
 	if (self) {
-		if (self->tx_msg)
-			buf_free(self->tx_msg);
+		for (i = 0; i < OBEX_MAXIMUM_QUEUE_DEPTH; i++)
+			obex_xfer_free(&self->tx_queue[i]);
+		for (i = 0; i < OBEX_MAXIMUM_READ_AHEAD; i++)
+			obex_xfer_free(&self->rx_queue[i]);
 
 		if (self->rx_msg)
 			buf_free(self->rx_msg);
 
 		libusb_release_interface(self->usb_dev, self->intf_num);
 		libusb_close(self->usb_dev);
-		libusb_exit(self->usb_ctx);
+		obex_usb_exit(self->usb_ctx, self->event_thread ? OBEX_FL_EVENT_THREAD : 0);
+		if (self->event_thread) {
+			close(self->cq_wake[0]);
+			close(self->cq_wake[1]);
+		}
+		while (!list_empty(&self->object_pool)) {
+			obex_object_t *object = list_entry(self->object_pool.next,
+							   obex_object_t, pool_link);
+			list_del(&object->pool_link);
+			obex_object_free(object);
+		}
+		obex_arena_free(self);
+		pthread_mutex_destroy(&self->mem_lock);
 		free(self);
 	}
 }
@@ -598,64 +1622,173 @@ void obex_register_callback(obex_t *self, obex_callback cb, void *userdata)
 	self->cb_userdata = userdata;
 }
 
+int obex_set_queue_depth(obex_t *self, int depth)
+{
+	int i;
+
+	if (self->tx_count > 0)
+		return -1;
+	if (depth < 1)
+		depth = 1;
+	if (depth > OBEX_MAXIMUM_QUEUE_DEPTH)
+		depth = OBEX_MAXIMUM_QUEUE_DEPTH;
+
+	for (i = 0; i < depth; i++) {
+		/* Leave room for the common header in front of the payload */
+		if (obex_xfer_init(self, &self->tx_queue[i], OBEX_MAXIMUM_MTU,
+				   sizeof(struct obex_common_hdr)) < 0)
+			return -1;
+	}
+	self->queue_depth = depth;
+	self->tx_head = 0;
+	return depth;
+}
+
+void obex_set_read_ahead(obex_t *self, int enable)
+{
+	self->read_ahead = enable;
+}
+
+/* Current round trip estimate, all values in microseconds. srtt and
+ * rttvar are 0 until the first response has been timed. */
+void obex_get_rtt(obex_t *self, int64_t *srtt, int64_t *rttvar, int64_t *rtt, int64_t *rto)
+{
+	if (srtt)
+		*srtt = self->srtt;
+	if (rttvar)
+		*rttvar = self->rttvar;
+	if (rtt)
+		*rtt = self->rtt;
+	if (rto)
+		*rto = self->rto;
+}
+
+/* Set the largest response the device may send. This is advertised in
+ * the CONNECT request, so it has to be set before connecting. */
+int obex_set_mtu_rx(obex_t *self, uint16_t mtu)
+{
+	if (self->mtu_tx_peer)
+		return -1;
+	if (mtu < OBEX_MINIMUM_MTU)
+		mtu = OBEX_MINIMUM_MTU;
+	self->mtu_rx = mtu;
+	return 0;
+}
+
+/* Set the largest packet that will be sent. Once connected the device's
+ * MTU still applies on top of this. */
+void obex_set_mtu(obex_t *self, uint16_t mtu)
+{
+	if (mtu < OBEX_MINIMUM_MTU)
+		mtu = OBEX_MINIMUM_MTU;
+	self->mtu_tx_max = mtu;
+	if (self->mtu_tx_peer)
+		self->mtu_tx = mtu < self->mtu_tx_peer ? mtu : self->mtu_tx_peer;
+	DEBUG(self, 2, "MTU limit=%d, used MTU=%d\n", self->mtu_tx_max, self->mtu_tx);
+}
+
+/* Take an object from the pool, or allocate one if it is empty. Pooled
+ * objects come back empty but still own their non-header buffers. */
 obex_object_t * obex_object_new(obex_t *self, uint8_t cmd)
 {
-	obex_object_t *object;
+	obex_object_t *object = NULL;
+
+	pthread_mutex_lock(&self->mem_lock);
+	if (!list_empty(&self->object_pool)) {
+		object = list_entry(self->object_pool.next, obex_object_t, pool_link);
+		list_del(&object->pool_link);
+		self->pool_count--;
+	}
+	pthread_mutex_unlock(&self->mem_lock);
+
+	if (object == NULL) {
+		object = malloc(sizeof(obex_object_t));
+		if (object == NULL)
+			return NULL;
+
+		memset(object, 0, sizeof(obex_object_t));
+
+		object->context = self;
+		INIT_LIST_HEAD(&object->tx_headerq);
+		INIT_LIST_HEAD(&object->rx_headerq);
+		INIT_LIST_HEAD(&object->rx_headerq_rm);
+	}
 
-	object =  malloc(sizeof(obex_object_t));
-	if (object == NULL)
+	if (obex_object_reset(self, object, cmd) < 0) {
+		obex_object_delete(self, object);
 		return NULL;
+	}
+	return object;
+}
 
-	memset(object, 0, sizeof(obex_object_t));
+/* Empty an object and make it a new request for cmd, as if it came from
+ * obex_object_new. Buffers the object already has are kept for reuse. */
+int obex_object_reset(obex_t *self, obex_object_t *object, uint8_t cmd)
+{
+	free_headerq(self, &object->tx_headerq);
+	free_headerq(self, &object->rx_headerq);
+	free_headerq(self, &object->rx_headerq_rm);
 
-	object->context = self;
+	buf_free(object->rx_body);
+	object->rx_body = NULL;
 
-	INIT_LIST_HEAD(&object->tx_headerq);
-	INIT_LIST_HEAD(&object->rx_headerq);
-	INIT_LIST_HEAD(&object->rx_headerq_rm);
+	if (object->tx_nonhdr_data)
+		buf_reuse(object->tx_nonhdr_data);
+	if (object->rx_nonhdr_data)
+		buf_reuse(object->rx_nonhdr_data);
 
+	object->time = 0;
 	object->cmd = cmd;
 	object->opcode = cmd;
 	object->lastopcode = cmd | OBEX_FINAL;
+	object->headeroffset = 0;
+	object->hinted_body_len = 0;
+	object->totallen = 0;
+	object->continue_received = 0;
+	object->rsp = -1;
+	object->write = NULL;
+	object->write_data = NULL;
+	object->written = 0;
 
 	/* Need some special woodoo magic on connect-frame */
 	if (cmd == OBEX_CMD_CONNECT) {
 		struct obex_connect_hdr *conn_hdr;
 
-		object->tx_nonhdr_data = buf_new(7);
-		if (!object->tx_nonhdr_data) {
-			obex_object_delete(self, object);
-			object = NULL;
-		} else {
-			conn_hdr = (struct obex_connect_hdr *) buf_reserve_end(object->tx_nonhdr_data, 7);
-			conn_hdr->version = self->version;
-			conn_hdr->flags = 0x40;              /* Flags */
-			conn_hdr->mtu = htons(self->mtu_rx); /* Max packet size */
-			memcpy(conn_hdr->unknown, "\x40\x00", 2); //unkown data sent during connect
-			conn_hdr->locale = self->locale;
+		if (object->tx_nonhdr_data == NULL) {
+			object->tx_nonhdr_data = buf_new(7);
+			if (!object->tx_nonhdr_data)
+				return -1;
 		}
+		conn_hdr = (struct obex_connect_hdr *) buf_reserve_end(object->tx_nonhdr_data, 7);
+		conn_hdr->version = self->version;
+		conn_hdr->flags = 0x40;              /* Flags */
+		conn_hdr->mtu = htons(self->mtu_rx); /* Max packet size */
+		memcpy(conn_hdr->unknown, "\x40\x00", 2); //unkown data sent during connect
+		conn_hdr->locale = self->locale;
 	}
-	return object;
+	return 0;
 }
 
 int obex_object_delete(obex_t *self, obex_object_t *object)
 {
 	/* Free the headerqueues */
-	free_headerq(&object->tx_headerq);
-	free_headerq(&object->rx_headerq);
-	free_headerq(&object->rx_headerq_rm);
-
-	/* Free tx and rx msgs */
-	buf_free(object->tx_nonhdr_data);
-	object->tx_nonhdr_data = NULL;
-
-	buf_free(object->rx_nonhdr_data);
-	object->rx_nonhdr_data = NULL;
+	free_headerq(self, &object->tx_headerq);
+	free_headerq(self, &object->rx_headerq);
+	free_headerq(self, &object->rx_headerq_rm);
 
 	buf_free(object->rx_body);
 	object->rx_body = NULL;
 
-	free(object);
+	pthread_mutex_lock(&self->mem_lock);
+	if (self->pool_count < OBEX_OBJECT_POOL) {
+		list_add(&object->pool_link, &self->object_pool);
+		self->pool_count++;
+		object = NULL;
+	}
+	pthread_mutex_unlock(&self->mem_lock);
+
+	if (object != NULL)
+		obex_object_free(object);
 
 	return 0;
 }
@@ -675,17 +1808,13 @@ int obex_object_addheader(obex_t *self, obex_object_t *object, uint8_t hi,
 		maxlen = self->mtu_tx - sizeof(struct obex_common_hdr);
 	}
 
-	element = malloc(sizeof(struct obex_header_element));
-	if (element == NULL)
-		return -1;
-
-	memset(element, 0, sizeof(struct obex_header_element));
-
-	element->hi = hi;
-	element->flags = flags;
-
 	if (hi == OBEX_HDR_EMPTY) {
 		DEBUG(self, 2, "Empty header\n");
+		element = obex_element_new(self, -1);
+		if (element == NULL)
+			return -1;
+		element->hi = hi;
+		element->flags = flags;
 		list_add_tail(&element->link, &object->tx_headerq);
 		return 1;
 	}
@@ -694,51 +1823,66 @@ int obex_object_addheader(obex_t *self, obex_object_t *object, uint8_t hi,
 	case OBEX_HDR_TYPE_UINT32:
 		DEBUG(self, 2, "4BQ header %d\n", hv.bq4);
 
-		element->buf = buf_new(sizeof(struct obex_uint_hdr));
-		if (element->buf) {
-			struct obex_uint_hdr *hdr;
-			ret = element->length = (unsigned int) sizeof(struct obex_uint_hdr);
-			hdr = (struct obex_uint_hdr *) buf_reserve_end(element->buf, sizeof(struct obex_uint_hdr));
-			hdr->hi = hi;
-			hdr->hv = htonl(hv.bq4);
+		element = obex_element_new(self, -1);
+		if (element) {
+			element->value = hv.bq4;
+			ret = element->length = sizeof(struct obex_uint_hdr);
 		}
 		break;
 
 	case OBEX_HDR_TYPE_UINT8:
 		DEBUG(self, 2, "1BQ header %d\n", hv.bq1);
 
-		element->buf = buf_new(sizeof(struct obex_ubyte_hdr));
-		if (element->buf) {
-			struct obex_ubyte_hdr *hdr;
+		element = obex_element_new(self, -1);
+		if (element) {
+			element->value = hv.bq1;
 			ret = element->length = sizeof(struct obex_ubyte_hdr);
-			hdr = (struct obex_ubyte_hdr *) buf_reserve_end(element->buf, sizeof(struct obex_ubyte_hdr));
-			hdr->hi = hi;
-			hdr->hv = hv.bq1;
 		}
 		break;
 
 	case OBEX_HDR_TYPE_BYTES:
 	case OBEX_HDR_TYPE_UNICODE:
+		if (hi == OBEX_HDR_BODY && (flags & OBEX_FL_BORROW_DATA)) {
+			DEBUG(self, 2, "Borrowed body size %d\n", hv_size);
+			element = obex_element_new(self, -1);
+			if (element) {
+				element->data = hv.bs;
+				ret = element->length = hv_size + sizeof(struct obex_byte_stream_hdr);
+			}
+			break;
+		}
+
 		DEBUG(self, 2, "BS/Unicode header size %d\n", hv_size);
 
-		element->buf = buf_new(hv_size + sizeof(struct obex_unicode_hdr));
-		if (element->buf) {
+		if (hi != OBEX_HDR_BODY) {
+			/* Encoded straight into the packet when sent */
+			element = obex_element_new_value(self, hv.bs, hv_size);
+			if (element)
+				ret = element->length = hv_size + sizeof(struct obex_unicode_hdr);
+			break;
+		}
+
+		element = obex_element_new(self, hv_size + sizeof(struct obex_unicode_hdr));
+		if (element) {
 			struct obex_unicode_hdr *hdr;
 			ret = element->length = hv_size + sizeof(struct obex_unicode_hdr);
 			hdr = (struct obex_unicode_hdr *) buf_reserve_end(element->buf, hv_size + sizeof(struct obex_unicode_hdr));
 			hdr->hi = hi;
 			hdr->hl = htons((uint16_t)(hv_size + sizeof(struct obex_unicode_hdr)));
 			memcpy(hdr->hv, hv.bs, hv_size);
-			hi++;
 		}
 		break;
 
 	default:
 		DEBUG(self, 2, "Unsupported encoding %02x\n", hi & OBEX_HDR_TYPE_MASK);
-		ret = -1;
-		break;
+		return -1;
 	}
 
+	if (element == NULL)
+		return -1;
+	element->hi = hi;
+	element->flags = flags;
+
 	/* Check if you can send this header without violating MTU or OBEX_FIT_ONE_PACKET */
 	if (element->hi != OBEX_HDR_BODY || (flags & OBEX_FL_FIT_ONE_PACKET)) {
 		if (maxlen < element->length) {
@@ -752,8 +1896,7 @@ int obex_object_addheader(obex_t *self, obex_object_t *object, uint8_t hi,
 		list_add_tail(&element->link, &object->tx_headerq);
 		ret = 1;
 	} else {
-		buf_free(element->buf);
-		free(element);
+		obex_element_free(self, element);
 	}
 
 	return ret;
@@ -762,7 +1905,6 @@ int obex_object_addheader(obex_t *self, obex_object_t *object, uint8_t hi,
 int obex_object_getnextheader(obex_t *self, obex_object_t *object, uint8_t *hi,
 			      obex_headerdata_t *hv, uint32_t *hv_size)
 {
-	uint32_t *bq4;
 	struct obex_header_element *h;
 
 	/* No more headers */
@@ -782,48 +1924,304 @@ int obex_object_getnextheader(obex_t *self, obex_object_t *object, uint8_t *hi,
 	switch (h->hi & OBEX_HDR_TYPE_MASK) {
 		case OBEX_HDR_TYPE_BYTES:
 		case OBEX_HDR_TYPE_UNICODE:
-			hv->bs = &h->buf->data[0];
+			/* Only bodies have a buffer of their own */
+			hv->bs = h->buf ? h->buf->data : h->data;
 			break;
 
 		case OBEX_HDR_TYPE_UINT32:
-			bq4 = (uint32_t*) h->buf->data;
-			hv->bq4 = ntohl(*bq4);
+			hv->bq4 = h->value;
 			break;
 
 		case OBEX_HDR_TYPE_UINT8:
-			hv->bq1 = h->buf->data[0];
+			hv->bq1 = h->value;
 			break;
 	}
 
 	return 1;
 }
 
-int obex_object_set_nonhdr_data(obex_object_t *object, const uint8_t *buffer, unsigned int len)
+static struct obex_header_element *obex_object_find_body(struct list_head *headerq)
 {
-	/* TODO: Check that we actually can send len bytes without violating MTU */
+	struct obex_header_element *h;
+	struct list_head *pos;
 
-	if (object->tx_nonhdr_data)
+	list_for_each(pos, headerq) {
+		h = list_entry(pos, struct obex_header_element, link);
+		if (h->hi == OBEX_HDR_BODY && h->buf && h->buf->buffer)
+			return h;
+	}
+	return NULL;
+}
+
+/* Hand the received body over to the caller without copying it. The
+ * returned block must be released with free(); the header stays in the
+ * object with an empty buffer. */
+uint8_t *obex_object_take_body(obex_object_t *object, uint32_t *len)
+{
+	struct obex_header_element *h;
+	uint8_t *data;
+
+	*len = 0;
+	h = obex_object_find_body(&object->rx_headerq_rm);
+	if (h == NULL)
+		h = obex_object_find_body(&object->rx_headerq);
+	if (h == NULL)
+		return NULL;
+
+	*len = h->buf->data_size;
+	h->length = 0;
+	if (h->arena) {
+		/* The arena is reused, hand out a copy */
+		data = malloc(*len ? *len : 1);
+		if (data != NULL)
+			memcpy(data, h->buf->data, *len);
+		buf_init(h->buf, NULL, 0);
+		return data;
+	}
+	return buf_detach(h->buf);
+}
+
+int obex_object_add_stream(obex_t *self, obex_object_t *object, uint32_t len,
+			   obex_read_callback read, void *userdata)
+{
+	struct obex_header_element *element;
+
+	element = malloc(sizeof(struct obex_header_element));
+	if (element == NULL)
 		return -1;
 
-	object->tx_nonhdr_data = buf_new(len);
-	if (object->tx_nonhdr_data == NULL)
+	memset(element, 0, sizeof(struct obex_header_element));
+
+	/* The buffer only holds the fragment being sent, it is refilled
+	   from the read callback for each packet */
+	element->buf = buf_new(self->mtu_tx);
+	if (element->buf == NULL) {
+		free(element);
 		return -1;
+	}
+
+	DEBUG(self, 2, "Streamed body size %d\n", len);
+	element->hi = OBEX_HDR_BODY;
+	element->length = len + sizeof(struct obex_byte_stream_hdr);
+	element->body_touched = 1;
+	element->read = read;
+	element->read_data = userdata;
+
+	object->totallen += element->length;
+	list_add_tail(&element->link, &object->tx_headerq);
+	return 1;
+}
+
+int obex_object_set_body_sink(obex_object_t *object, obex_write_callback write,
+			       void *userdata)
+{
+	object->write = write;
+	object->write_data = userdata;
+	return 1;
+}
+
+int obex_object_set_nonhdr_data(obex_object_t *object, const uint8_t *buffer, unsigned int len)
+{
+	/* TODO: Check that we actually can send len bytes without violating MTU */
+
+	if (object->tx_nonhdr_data) {
+		if (object->tx_nonhdr_data->data_size > 0)
+			return -1;
+	} else {
+		object->tx_nonhdr_data = buf_new(len);
+		if (object->tx_nonhdr_data == NULL)
+			return -1;
+	}
 
 	buf_insert_end(object->tx_nonhdr_data, (uint8_t *)buffer, len);
 
 	return 1;
 }
 
+/* Send the first packets of a request and return without waiting for
+ * the answers. The request is then driven by obex_request_step. */
+int obex_request_start(obex_t *self, obex_object_t *object)
+{
+	if (self->object != NULL)
+		return -1;
+	self->single = object;
+	return obex_request_start_batch(self, &self->single, 1);
+}
+
+/* Start several requests as one. They are sent in order, each as soon as
+ * the responses to the packets before it can no longer change what is
+ * sent next, and up to the queue depth may be in flight. The response of
+ * each request is left in its rsp field and the batch completes with the
+ * first one other than SUCCESS. Every request is sent even if one before
+ * it fails, unless it was refused before its last packet went out. The
+ * objects array must stay valid until obex_request_result. */
+int obex_request_start_batch(obex_t *self, obex_object_t **objects, int count)
+{
+	int i;
+
+	if (self->object != NULL || count < 1)
+		return -1;
+
+	for (i = 0; i < count; i++)
+		objects[i]->rsp = -1;
+	self->batch = objects;
+	self->batch_count = count;
+	self->batch_tx = 0;
+	self->batch_rx = 0;
+	self->tx_head = 0;
+	self->tx_count = 0;
+	self->tx_finished = 0;
+	self->rx_head = 0;
+	self->rx_count = 0;
+	self->rx_empty = 0;
+	self->rx_timeouts = 0;
+	self->stopping = 0;
+	self->done = 0;
+	self->rsp = -1;
+	self->resync = 0;
+	self->retries = 0;
+	self->abort = 0;
+	buf_reuse(self->rx_msg);
+	/* From here on obex_request_abort flags this request. One that came
+	   while none was running ends it before anything is sent. */
+	self->object = objects[0];
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if (self->abort_pending) {
+		self->abort_pending = 0;
+		obex_request_finish(self, LIBUSB_ERROR_INTERRUPTED);
+		return 0;
+	}
+
+	if (self->rx_stale) {
+		self->rx_stale = 0;
+		self->draining = OBEX_MAXIMUM_READ_AHEAD;
+		if (obex_bulk_read(self) == 0)
+			return 0;
+		self->draining = 0;
+	}
+	obex_fill_queue(self);
+	return 0;
+}
+
+/* Handle pending usb events, waiting at most tv for one (forever if tv is
+ * NULL). Returns 1 once the request has completed, 0 while it is still in
+ * progress. */
+int obex_request_step(obex_t *self, struct timeval *tv)
+{
+	int ret;
+
+	if (self->object == NULL)
+		return 1;
+	if (!self->done && self->event_thread) {
+		ret = obex_wait_completions(self, tv);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+			obex_request_finish(self, ret);
+	} else if (!self->done) {
+		if (tv == NULL)
+			ret = libusb_handle_events_completed(self->usb_ctx, &self->done);
+		else
+			ret = libusb_handle_events_timeout_completed(self->usb_ctx, tv, &self->done);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+			obex_request_finish(self, ret);
+	}
+	return self->done;
+}
+
+/* Return the response of a completed request and release the context
+ * for the next one */
+int obex_request_result(obex_t *self)
+{
+	self->object = NULL;
+	self->batch = NULL;
+	self->batch_count = 0;
+	return self->rsp;
+}
+
+/* Ask for the request in progress to end early. Packets already sent are
+ * answered first, then an ABORT is sent in place of the next packet, so
+ * the device is left ready for the next request. The request completes
+ * with LIBUSB_ERROR_INTERRUPTED, or normally if its final packet was
+ * already on the way. When no request is running the next one started
+ * ends with LIBUSB_ERROR_INTERRUPTED before it sends anything. Only sets
+ * a flag, so it may be called from callbacks or signal handlers. */
+int obex_request_abort(obex_t *self)
+{
+	if (self->object == NULL) {
+		self->abort_pending = 1;
+		return 0;
+	}
+	if (self->done)
+		return -1;
+	self->abort = 1;
+	return 0;
+}
+
 int obex_request(obex_t *self, obex_object_t *object)
 {
-	int ret, rsp;
-	do {
-		ret = obex_object_send(self, object);
-		if (ret < 0)
-			return ret;
-		rsp = obex_object_receive(self, object);
-		if (self->callback)
-			self->callback(self, object, self->cb_userdata);
-	} while (rsp == OBEX_RSP_CONTINUE);
-	return rsp;
+	if (obex_request_start(self, object) < 0)
+		return -1;
+	while (!obex_request_step(self, NULL))
+		;
+	return obex_request_result(self);
+}
+
+int obex_request_batch(obex_t *self, obex_object_t **objects, int count)
+{
+	if (obex_request_start_batch(self, objects, count) < 0)
+		return -1;
+	while (!obex_request_step(self, NULL))
+		;
+	return obex_request_result(self);
+}
+
+const struct libusb_pollfd **obex_get_pollfds(obex_t *self)
+{
+	const struct libusb_pollfd **pollfds;
+
+	/* With the event thread only the completion pipe has to be watched */
+	if (self->event_thread) {
+		pollfds = malloc(2 * sizeof(*pollfds));
+		if (pollfds == NULL)
+			return NULL;
+		pollfds[0] = &self->cq_pollfd;
+		pollfds[1] = NULL;
+		return pollfds;
+	}
+	return libusb_get_pollfds(self->usb_ctx);
+}
+
+void obex_free_pollfds(obex_t *self, const struct libusb_pollfd **pollfds)
+{
+	/* libusb_free_pollfds only exists since libusb 1.0.20, before that
+	 * its list was freed with free() too */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000104
+	if (!self->event_thread) {
+		libusb_free_pollfds(pollfds);
+		return;
+	}
+#endif
+	free((void *) pollfds);
+}
+
+/* Milliseconds until usb events have to be handled even if no file
+ * descriptor became ready, -1 if there is no such deadline */
+int obex_get_timeout(obex_t *self)
+{
+	struct timeval tv;
+
+	/* Transfer timeouts are handled by the event thread */
+	if (self->event_thread)
+		return -1;
+	if (libusb_get_next_timeout(self->usb_ctx, &tv) != 1)
+		return -1;
+	return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+void obex_set_pollfd_notifiers(obex_t *self, libusb_pollfd_added_cb added,
+			       libusb_pollfd_removed_cb removed, void *userdata)
+{
+	/* The completion pipe stays the same while the session is open */
+	if (self->event_thread)
+		return;
+	libusb_set_pollfd_notifiers(self->usb_ctx, added, removed, userdata);
 }
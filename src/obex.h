@@ -27,6 +27,8 @@
 #define OBEX_H
 
 #include <libusb.h>
+#include <pthread.h>
+#include <signal.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,9 +49,16 @@
 
 #define OBEX_OBJECT_ALLOCATIONTRESHOLD 10240
 
+/* Size of the blocks the arena of a session takes from the heap. Header
+   elements with more data than a quarter of this are taken from the heap
+   directly. */
+#define OBEX_ARENA_BLOCK	4096
+
 #define OBEX_VERSION		0x11
 
 #define OBEX_FL_FIT_ONE_PACKET	0x01	/* This header must fit in one packet */
+#define OBEX_FL_BORROW_DATA	0x02	/* Send body from caller memory, which must
+					   stay valid until the request is done */
 
 #define OBEX_HDR_TYPE_UNICODE	(0 << 6)  /* zero terminated unicode string (network byte order) */
 #define OBEX_HDR_TYPE_BYTES	(1 << 6)  /* byte array */
@@ -104,6 +113,7 @@
 #define OBEX_CMD_PUT		0x02
 #define OBEX_CMD_GET		0x03
 #define OBEX_CMD_SETPATH	0x05
+#define OBEX_CMD_ABORT		0x7f
 #define OBEX_FINAL		0x80
 
 /* Responses */
@@ -151,10 +161,47 @@
 #define OBEX_DEFAULT_MTU	4096
 #define OBEX_MINIMUM_MTU	255
 #define OBEX_MAXIMUM_MTU	65535
+#define OBEX_DEFAULT_RX_MTU	16384	/* Advertised on connect, responses are
+					   reassembled from as many reads as needed */
+
+/* Number of PUT packets that may be in flight before a response is read */
+#define OBEX_DEFAULT_QUEUE_DEPTH	1
+#define OBEX_MAXIMUM_QUEUE_DEPTH	8
+
+/* Reads that may be posted when read-ahead is on (seq + response per packet) */
+#define OBEX_MAXIMUM_READ_AHEAD		(2 * OBEX_MAXIMUM_QUEUE_DEPTH)
+
+/* Retransmission timeout (in us) of a single usb transfer. Starts at
+   OBEX_RTO_INITIAL and is then derived from the measured round trip time
+   of each packet, like the TCP RTO (RFC 6298). */
+#define OBEX_RTO_INITIAL	1245000
+#define OBEX_RTO_MIN		50000
+#define OBEX_RTO_MAX		1245000
+
+/* Time (in us) a transfer is given per byte on top of the RTO, which is
+   learned from small packets. Full speed usb moves about 1 MB/s. */
+#define OBEX_TIMEOUT_PER_BYTE	2
+
+/* Times packets that failed before any byte reached the device are sent
+   again before the request fails. Other transfer errors are not retried,
+   the device may already have acted on the packet. */
+#define OBEX_MAXIMUM_RETRIES	3
+
+/* Deleted objects a session keeps for the next requests */
+#define OBEX_OBJECT_POOL	4
+
+/* obex_init flags */
+#define OBEX_FL_EVENT_THREAD	0x01	/* Use the shared usb event thread */
+
+/* Completed transfers queued by the event thread, a power of two larger
+   than the number of transfers a session can have in flight */
+#define OBEX_COMPLETION_RING	32
 
 struct _obex_object;
 struct _obex;
 typedef void (*obex_callback)(struct _obex *, struct _obex_object *, void *);
+typedef int (*obex_read_callback)(char *buffer, int len, void *userdata);
+typedef int (*obex_write_callback)(const char *buffer, int len, void *userdata);
 
 typedef union {
 	uint32_t bq4;
@@ -162,6 +209,28 @@ typedef union {
 	const uint8_t *bs;
 } obex_headerdata_t;
 
+struct obex_arena_block {
+	struct obex_arena_block *next;
+	size_t size;
+	size_t used;
+	size_t live;			/* Allocations not released yet */
+	uint8_t data[0];		/* Keeps the size_t alignment */
+};
+
+struct obex_xfer {
+	struct _obex *context;
+	struct libusb_transfer *transfer;
+	buf_t *buf;
+	struct _obex_object *object;	/* Request the packet belongs to */
+	uint8_t seq;
+	int finished;		/* Packet carries the final bit */
+	int abort;		/* Packet is an ABORT */
+	int gate;		/* Response decides what is sent next */
+	int64_t sent;		/* Time packet was submitted (us) */
+	int acked;		/* Sequence number has been echoed */
+	int busy;		/* Submitted and not completed yet */
+};
+
 typedef struct _obex {
 	struct libusb_context *usb_ctx;
 	struct libusb_device_handle *usb_dev;
@@ -173,6 +242,7 @@ typedef struct _obex {
 	uint16_t mtu_rx;
 	uint16_t mtu_tx;
 	uint16_t mtu_tx_max;
+	uint16_t mtu_tx_peer;		/* MTU advertised by device, 0 when not connected */
 	buf_t *tx_msg;
 	buf_t *rx_msg;
 	int debug;
@@ -180,6 +250,55 @@ typedef struct _obex {
 	int16_t seq_check;
 	obex_callback callback;
 	void * cb_userdata;
+
+	struct obex_xfer tx_queue[OBEX_MAXIMUM_QUEUE_DEPTH];
+	struct obex_xfer rx_queue[OBEX_MAXIMUM_READ_AHEAD];
+	int queue_depth;
+	int read_ahead;			/* Post reads for every expected message */
+	int tx_head;			/* Oldest packet waiting for a response */
+	int tx_count;			/* Packets sent but not answered yet */
+	int tx_finished;		/* Final packet of request has been sent */
+	int rx_head;			/* Oldest posted read */
+	int rx_count;			/* Reads posted but not consumed yet */
+	int rx_empty;			/* Number of zero length reads in a row */
+	int rx_timeouts;		/* Reads timed out since last rtt sample */
+	int64_t srtt;			/* Smoothed round trip time (us) */
+	int64_t rttvar;			/* Round trip time variation (us) */
+	int64_t rtt;			/* Last round trip time sample (us) */
+	int64_t rto;			/* Current transfer timeout (us) */
+	struct _obex_object *object;	/* Request packets are taken from */
+	struct _obex_object **batch;	/* Requests sent back to back */
+	struct _obex_object *single;	/* Batch of obex_request_start */
+	int batch_count;
+	int batch_tx;			/* Index of object in the batch */
+	int batch_rx;			/* Oldest request not answered yet */
+	int stopping;			/* No more packets will be sent */
+	int done;			/* Request completed */
+	int rsp;			/* Response or error code of request */
+	int resync;			/* Packets lost before reaching the device
+					   are resent once none is in flight */
+	int resync_from;		/* Position of the first one to resend */
+	int resync_halt;		/* Write endpoint stalled, clear it first */
+	int rx_stale;			/* A failed request may have left answers */
+	int draining;			/* Reads left to throw them away */
+	volatile sig_atomic_t abort;	/* Abort requested, end with an ABORT packet */
+	volatile sig_atomic_t abort_pending; /* Abort requested between requests */
+	int retries;			/* Resyncs done for this request */
+
+	int event_thread;		/* usb_ctx is handled by the event thread */
+	struct obex_xfer *cq_ring[OBEX_COMPLETION_RING];
+	unsigned int cq_head;		/* Next completion to handle (session) */
+	unsigned int cq_tail;		/* Next free slot (event thread) */
+	int cq_wake[2];			/* Pipe written when the ring was empty */
+	struct libusb_pollfd cq_pollfd;
+
+	pthread_mutex_t mem_lock;	/* Arena and object pool, objects may
+					   be built in any thread */
+	struct obex_arena_block *arena;	/* Header memory blocks */
+	struct list_head object_pool;	/* Deleted objects kept for reuse */
+	int pool_count;
+	struct list_head rx_views;	/* Received headers still pointing
+					   into rx_msg */
 } obex_t;
 
 #pragma pack(1)
@@ -233,12 +352,21 @@ struct obex_unicode_hdr {
 
 struct obex_header_element {
 	buf_t *buf;
+	const uint8_t *data;		/* Caller memory of a borrowed body, or
+					   value of a queued byte sequence */
+	uint32_t value;			/* Value of a queued 1 or 4 byte header */
+	obex_read_callback read;	/* Source of a streamed body */
+	void *read_data;
 	uint8_t hi;
 	unsigned int flags;
 	unsigned int length;
 	unsigned int offset;
 	int body_touched;
+	int arena;			/* Element and buffer belong to the arena */
+	int view;			/* data points into the session's rx_msg */
+	int pinned;			/* data is a copy in the arena */
 	struct list_head link;
+	struct list_head view_link;	/* Entry in the session's rx_views */
 };
 
 typedef struct _obex_object {
@@ -267,21 +395,52 @@ typedef struct _obex_object {
 	int totallen;			/* Size of all headers */
 
 	int continue_received;		/* CONTINUE received after sending last command */
+	int rsp;			/* Final response or error, -1 if the
+					   request was never completed */
+
+	obex_write_callback write;	/* Sink for received body fragments */
+	void *write_data;
+	unsigned int written;		/* Body bytes handed to the sink */
 
+	struct list_head pool_link;	/* Entry in the session's object pool */
 } obex_object_t;
 
-obex_t * obex_init(uint16_t vid, uint16_t pid);
+libusb_context * obex_usb_init(int flags);
+void obex_usb_exit(libusb_context *ctx, int flags);
+obex_t * obex_init(libusb_context *ctx, libusb_device_handle *dev, int flags);
 void obex_cleanup(obex_t *self);
 void obex_set_connect_info(obex_t *self, uint8_t ver, uint8_t locale);
 void obex_register_callback(obex_t *self, obex_callback cb, void * userdata);
+int obex_set_queue_depth(obex_t *self, int depth);
+void obex_set_read_ahead(obex_t *self, int enable);
+void obex_set_mtu(obex_t *self, uint16_t mtu);
+int obex_set_mtu_rx(obex_t *self, uint16_t mtu);
+void obex_get_rtt(obex_t *self, int64_t *srtt, int64_t *rttvar, int64_t *rtt, int64_t *rto);
 obex_object_t * obex_object_new(obex_t *self, uint8_t cmd);
 int obex_object_delete(obex_t *self, obex_object_t *object);
+int obex_object_reset(obex_t *self, obex_object_t *object, uint8_t cmd);
 int obex_object_add_header(obex_t *self, obex_object_t *object,
 			   uint8_t hi, obex_headerdata_t hv, uint32_t hv_size,
 			   unsigned int flags);
 int obex_object_getnextheader(obex_t *self, obex_object_t *object,
 			      uint8_t *hi, obex_headerdata_t *hv, uint32_t *hv_size);
+uint8_t *obex_object_take_body(obex_object_t *object, uint32_t *len);
+int obex_object_add_stream(obex_t *self, obex_object_t *object, uint32_t len,
+			   obex_read_callback read, void *userdata);
+int obex_object_set_body_sink(obex_object_t *object, obex_write_callback write,
+			       void *userdata);
 int obex_object_set_nonhdr_data(obex_object_t *object, const uint8_t *buffer, unsigned int len);
 int obex_request(obex_t *self, obex_object_t *object);
+int obex_request_batch(obex_t *self, obex_object_t **objects, int count);
+int obex_request_start(obex_t *self, obex_object_t *object);
+int obex_request_start_batch(obex_t *self, obex_object_t **objects, int count);
+int obex_request_step(obex_t *self, struct timeval *tv);
+int obex_request_result(obex_t *self);
+int obex_request_abort(obex_t *self);
+const struct libusb_pollfd **obex_get_pollfds(obex_t *self);
+void obex_free_pollfds(obex_t *self, const struct libusb_pollfd **pollfds);
+int obex_get_timeout(obex_t *self);
+void obex_set_pollfd_notifiers(obex_t *self, libusb_pollfd_added_cb added,
+			       libusb_pollfd_removed_cb removed, void *userdata);
 
 #endif
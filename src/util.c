@@ -25,6 +25,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
+#include <unistd.h>
 
 #if defined(__MINGW32__)
 # include <shlwapi.h>
@@ -140,6 +142,72 @@ int read_file(const char* filename, char **buffer, int *len)
 	return 0x20;
 }
 
+int open_file(const char* filename, int *len)
+{
+	int fd;
+	struct stat buf;
+	*len = 0;
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &buf) < 0) {
+		close(fd);
+		return -1;
+	}
+	*len = buf.st_size;
+	return fd;
+}
+
+int read_fd(char *buffer, int len, void *user_data)
+{
+	return read(*((int *)user_data), buffer, len);
+}
+
+/* Creates a new file next to filename to collect data that only replaces
+ * filename once it is complete, see replace_file. */
+int create_temp_file(const char* filename, char **tmpname)
+{
+	int fd, i;
+	*tmpname = xmalloc(strlen(filename) + 16);
+	for (i = 0; i < 100; i++) {
+		sprintf(*tmpname, "%s.%d.part", filename, (int) (getpid() + i) % 100000);
+		fd = open(*tmpname, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, S_IRUSR | S_IWUSR);
+		if (fd >= 0)
+			return fd;
+		if (errno != EEXIST)
+			break;
+	}
+	free(*tmpname);
+	*tmpname = NULL;
+	return -1;
+}
+
+int replace_file(const char* tmpname, const char* filename)
+{
+#if defined(__MINGW32__)
+	/* rename does not replace an existing file on windows */
+	unlink(filename);
+#endif
+	return rename(tmpname, filename);
+}
+
+/* Writes all of buffer, returns len or -1 */
+int write_fd(const char *buffer, int len, void *user_data)
+{
+	int fd = *((int *)user_data);
+	int ret, done = 0;
+	while (done < len) {
+		ret = write(fd, buffer + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += ret;
+	}
+	return len;
+}
+
 int write_file(const char* filename, char *buffer, int len)
 {
 	int fd, ret;
@@ -147,7 +215,7 @@ int write_file(const char* filename, char *buffer, int len)
 	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, S_IRUSR | S_IWUSR);
 	if (fd < 0)
 		return 0x43;
-	ret = write(fd, buffer, len);
+	ret = write_fd(buffer, len, &fd);
 	if (ret < 0) {
 		close(fd);
 		return 0x50;
@@ -29,6 +29,11 @@
 void * xmalloc(size_t n);
 int write_file(const char* filename, char *buffer, int len);
 int read_file(const char* filename, char **buffer, int *len);
+int open_file(const char* filename, int *len);
+int read_fd(char *buffer, int len, void *user_data);
+int create_temp_file(const char* filename, char **tmpname);
+int replace_file(const char* tmpname, const char* filename);
+int write_fd(const char *buffer, int len, void *user_data);
 const char * get_data_dir();
 char * mkpath(const char *id, const char *filename);
 
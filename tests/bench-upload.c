@@ -0,0 +1,85 @@
+/* libexword - library for transffering files to Casio-EX-Word dictionaries
+ *
+ * Copyright (C) 2010 - Brian Johnson <brijohn@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *
+ */
+
+/* Times an upload to the emulated device at each queue depth. The device
+ * takes mock_latency_us to accept a packet and as long again to answer it,
+ * so the gain from queued packets shows without real hardware.
+ *
+ * usage: bench-upload [size in bytes] [latency in us] [runs] */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "exword.h"
+#include "mockusb.h"
+
+static int failures;
+
+static double now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+	int size = argc > 1 ? atoi(argv[1]) : 2 * 1024 * 1024;
+	int latency = argc > 2 ? atoi(argv[2]) : 300;
+	int runs = argc > 3 ? atoi(argv[3]) : 5;
+	int depths[] = { 1, 2, 4, 8 };
+	const char *stored;
+	double start, t, best;
+	exword_t *dev;
+	char *data;
+	int i, j, len;
+
+	data = malloc(size);
+	if (data == NULL)
+		return 1;
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+	dev = exword_open();
+	if (dev == NULL)
+		return 1;
+	CHECK(exword_connect(dev) == 0x20);
+	printf("%d byte upload, %dus device latency, mtu %u, best of %d\n",
+	       size, latency, exword_get_mtu(dev), runs);
+	mock_latency_us = latency;
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		exword_set_queue_depth(dev, depths[i]);
+		best = 0;
+		for (j = 0; j < runs; j++) {
+			start = now_ms();
+			CHECK(exword_send_file(dev, "bench.bin", data, size) == 0x20);
+			t = now_ms() - start;
+			if (j == 0 || t < best)
+				best = t;
+		}
+		CHECK(mock_get("bench.bin", &stored, &len) == 0);
+		CHECK(len == size && memcmp(stored, data, size) == 0);
+		printf("depth %d: %.1fms\n", depths[i], best);
+	}
+	exword_disconnect(dev);
+	exword_close(dev);
+	free(data);
+	return failures ? 1 : 0;
+}
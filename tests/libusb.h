@@ -0,0 +1,231 @@
+/* libexword - library for transffering files to Casio-EX-Word dictionaries
+ *
+ * Copyright (C) 2010 - Brian Johnson <brijohn@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *
+ */
+
+/* The subset of libusb-1.0 used by libexword. The tests build the library
+ * against this header and link it with mockusb.c instead of the real
+ * libusb, so they run without a device attached. */
+
+#ifndef MOCK_LIBUSB_H
+#define MOCK_LIBUSB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define LIBUSB_CALL
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
+typedef struct libusb_device_handle libusb_device_handle;
+
+enum libusb_error {
+	LIBUSB_SUCCESS = 0,
+	LIBUSB_ERROR_IO = -1,
+	LIBUSB_ERROR_INVALID_PARAM = -2,
+	LIBUSB_ERROR_ACCESS = -3,
+	LIBUSB_ERROR_NO_DEVICE = -4,
+	LIBUSB_ERROR_NOT_FOUND = -5,
+	LIBUSB_ERROR_BUSY = -6,
+	LIBUSB_ERROR_TIMEOUT = -7,
+	LIBUSB_ERROR_OVERFLOW = -8,
+	LIBUSB_ERROR_PIPE = -9,
+	LIBUSB_ERROR_INTERRUPTED = -10,
+	LIBUSB_ERROR_NO_MEM = -11,
+	LIBUSB_ERROR_NOT_SUPPORTED = -12,
+	LIBUSB_ERROR_OTHER = -99
+};
+
+enum libusb_endpoint_direction {
+	LIBUSB_ENDPOINT_IN = 0x80,
+	LIBUSB_ENDPOINT_OUT = 0x00
+};
+
+enum libusb_transfer_type {
+	LIBUSB_TRANSFER_TYPE_BULK = 2
+};
+
+enum libusb_transfer_status {
+	LIBUSB_TRANSFER_COMPLETED,
+	LIBUSB_TRANSFER_ERROR,
+	LIBUSB_TRANSFER_TIMED_OUT,
+	LIBUSB_TRANSFER_CANCELLED,
+	LIBUSB_TRANSFER_STALL,
+	LIBUSB_TRANSFER_NO_DEVICE,
+	LIBUSB_TRANSFER_OVERFLOW
+};
+
+enum libusb_capability {
+	LIBUSB_CAP_HAS_HOTPLUG = 0x0001
+};
+
+typedef enum {
+	LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED = 0x01,
+	LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT = 0x02
+} libusb_hotplug_event;
+
+typedef enum {
+	LIBUSB_HOTPLUG_NO_FLAGS = 0,
+	LIBUSB_HOTPLUG_ENUMERATE = 1
+} libusb_hotplug_flag;
+
+#define LIBUSB_HOTPLUG_MATCH_ANY -1
+
+typedef int libusb_hotplug_callback_handle;
+typedef int (*libusb_hotplug_callback_fn)(libusb_context *ctx,
+		libusb_device *device, libusb_hotplug_event event,
+		void *user_data);
+
+struct libusb_device_descriptor {
+	uint8_t  bLength;
+	uint8_t  bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t  bDeviceClass;
+	uint8_t  bDeviceSubClass;
+	uint8_t  bDeviceProtocol;
+	uint8_t  bMaxPacketSize0;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t  iManufacturer;
+	uint8_t  iProduct;
+	uint8_t  iSerialNumber;
+	uint8_t  bNumConfigurations;
+};
+
+struct libusb_endpoint_descriptor {
+	uint8_t  bLength;
+	uint8_t  bDescriptorType;
+	uint8_t  bEndpointAddress;
+	uint8_t  bmAttributes;
+	uint16_t wMaxPacketSize;
+};
+
+struct libusb_interface_descriptor {
+	uint8_t  bInterfaceNumber;
+	uint8_t  bAlternateSetting;
+	uint8_t  bNumEndpoints;
+	const struct libusb_endpoint_descriptor *endpoint;
+};
+
+struct libusb_interface {
+	const struct libusb_interface_descriptor *altsetting;
+	int num_altsetting;
+};
+
+struct libusb_config_descriptor {
+	uint8_t  bNumInterfaces;
+	const struct libusb_interface *interface;
+};
+
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+
+struct libusb_transfer {
+	libusb_device_handle *dev_handle;
+	uint8_t flags;
+	unsigned char endpoint;
+	unsigned char type;
+	unsigned int timeout;
+	enum libusb_transfer_status status;
+	int length;
+	int actual_length;
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	unsigned char *buffer;
+	int num_iso_packets;
+};
+
+struct libusb_pollfd {
+	int fd;
+	short events;
+};
+
+typedef void (*libusb_pollfd_added_cb)(int fd, short events, void *user_data);
+typedef void (*libusb_pollfd_removed_cb)(int fd, void *user_data);
+
+int libusb_init(libusb_context **ctx);
+void libusb_exit(libusb_context *ctx);
+int libusb_has_capability(uint32_t capability);
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list);
+void libusb_free_device_list(libusb_device **list, int unref_devices);
+libusb_device *libusb_ref_device(libusb_device *dev);
+void libusb_unref_device(libusb_device *dev);
+uint8_t libusb_get_bus_number(libusb_device *dev);
+uint8_t libusb_get_device_address(libusb_device *dev);
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int len);
+int libusb_get_device_descriptor(libusb_device *dev,
+		struct libusb_device_descriptor *desc);
+int libusb_get_active_config_descriptor(libusb_device *dev,
+		struct libusb_config_descriptor **config);
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config);
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle);
+void libusb_close(libusb_device_handle *handle);
+libusb_device *libusb_get_device(libusb_device_handle *handle);
+int libusb_get_string_descriptor_ascii(libusb_device_handle *handle,
+		uint8_t desc_index, unsigned char *data, int length);
+int libusb_claim_interface(libusb_device_handle *handle, int interface_number);
+int libusb_release_interface(libusb_device_handle *handle, int interface_number);
+int libusb_set_interface_alt_setting(libusb_device_handle *handle,
+		int interface_number, int alternate_setting);
+int libusb_clear_halt(libusb_device_handle *handle, unsigned char endpoint);
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets);
+void libusb_free_transfer(struct libusb_transfer *transfer);
+int libusb_submit_transfer(struct libusb_transfer *transfer);
+int libusb_cancel_transfer(struct libusb_transfer *transfer);
+
+static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
+		libusb_device_handle *dev_handle, unsigned char endpoint,
+		unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+		void *user_data, unsigned int timeout)
+{
+	transfer->dev_handle = dev_handle;
+	transfer->endpoint = endpoint;
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+	transfer->timeout = timeout;
+	transfer->buffer = buffer;
+	transfer->length = length;
+	transfer->user_data = user_data;
+	transfer->callback = callback;
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed);
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+		struct timeval *tv, int *completed);
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv);
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx);
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds);
+void libusb_set_pollfd_notifiers(libusb_context *ctx,
+		libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+		void *user_data);
+
+int libusb_hotplug_register_callback(libusb_context *ctx,
+		libusb_hotplug_event events, libusb_hotplug_flag flags,
+		int vendor_id, int product_id, int dev_class,
+		libusb_hotplug_callback_fn cb_fn, void *user_data,
+		libusb_hotplug_callback_handle *handle);
+void libusb_hotplug_deregister_callback(libusb_context *ctx,
+		libusb_hotplug_callback_handle handle);
+
+#endif
@@ -0,0 +1,682 @@
+/* libexword - library for transffering files to Casio-EX-Word dictionaries
+ *
+ * Copyright (C) 2010 - Brian Johnson <brijohn@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *
+ */
+
+/* A libusb replacement that emulates an Ex-word dictionary. Every OUT
+ * transfer is handed to the device as soon as it is submitted; the device
+ * answers with the sequence byte followed by the OBEX response, each as its
+ * own IN message. Transfers complete from libusb_handle_events_* in the
+ * order the device would finish them, taking mock_latency_us per packet.
+ * mock_fail_write makes one write fail before it reaches the device and
+ * mock_repeat_answer makes the device answer one packet twice. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libusb.h"
+#include "mockusb.h"
+
+#define MOCK_MAX_FILES 64
+#define MOCK_DEVICE_MTU 0x4006
+
+int mock_latency_us;
+char mock_refuse[32];
+int mock_fail_write;
+int mock_fail_status;
+int mock_repeat_answer;
+int mock_writes;
+int mock_max_inflight;
+int mock_aborts;
+int mock_errors;
+int mock_gate_violations;
+int mock_clear_halts;
+char mock_log[MOCK_LOG_SIZE][40];
+int mock_nlog;
+
+struct libusb_context {
+	int unused;
+};
+
+struct libusb_device {
+	int unused;
+};
+
+struct libusb_device_handle {
+	libusb_device *dev;
+};
+
+struct mock_file {
+	char name[256];
+	char *data;
+	int len;
+};
+
+struct mock_msg {
+	struct mock_msg *next;
+	double ready;
+	int len;
+	unsigned char data[];
+};
+
+struct mock_pending {
+	struct mock_pending *next;
+	struct libusb_transfer *transfer;
+	double ready;
+	int cancelled;
+	int status;		/* failed without reaching the device */
+};
+
+static pthread_mutex_t mock_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static libusb_device mock_dev;
+
+static struct mock_file files[MOCK_MAX_FILES];
+static int nfiles;
+
+static struct mock_msg *in_head, *in_tail;
+static struct mock_pending *pending;
+static int inflight;
+static double busy_until;
+static int out_halted;
+
+static int client_mtu = 0xff;
+static uint8_t expect_seq;
+static int seq_valid;
+static int gated;
+static char name[256];
+static char *put_body;
+static int put_len;
+static const char *get_data;
+static int get_len, get_off, get_active;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct mock_file *find_file(const char *fname)
+{
+	int i;
+	for (i = 0; i < nfiles; i++) {
+		if (strcmp(files[i].name, fname) == 0)
+			return &files[i];
+	}
+	return NULL;
+}
+
+int mock_put(const char *fname, const char *data, int len)
+{
+	struct mock_file *f = find_file(fname);
+	if (f == NULL) {
+		if (nfiles == MOCK_MAX_FILES)
+			return -1;
+		f = &files[nfiles++];
+		snprintf(f->name, sizeof(f->name), "%s", fname);
+	}
+	free(f->data);
+	f->data = malloc(len + 1);
+	memcpy(f->data, data, len);
+	f->len = len;
+	return 0;
+}
+
+int mock_get(const char *fname, const char **data, int *len)
+{
+	struct mock_file *f = find_file(fname);
+	if (f == NULL)
+		return -1;
+	*data = f->data;
+	*len = f->len;
+	return 0;
+}
+
+static void queue_in(const unsigned char *data, int len, double ready)
+{
+	struct mock_msg *m = malloc(sizeof(*m) + len);
+	m->next = NULL;
+	m->ready = ready;
+	m->len = len;
+	memcpy(m->data, data, len);
+	if (in_tail)
+		in_tail->next = m;
+	else
+		in_head = m;
+	in_tail = m;
+}
+
+static void reset_put(void)
+{
+	free(put_body);
+	put_body = NULL;
+	put_len = 0;
+}
+
+static int get_response(unsigned char *rsp)
+{
+	int len = 3, chunk;
+	int room = client_mtu - 3 - 5 - 3;
+	uint32_t total;
+	uint16_t hl;
+
+	if (get_off == 0) {
+		rsp[len++] = 0xc3;
+		total = htonl(get_len);
+		memcpy(rsp + len, &total, 4);
+		len += 4;
+	}
+	chunk = get_len - get_off;
+	if (chunk > room)
+		chunk = room;
+	rsp[len++] = (get_off + chunk == get_len) ? 0x49 : 0x48;
+	hl = htons(chunk + 3);
+	memcpy(rsp + len, &hl, 2);
+	len += 2;
+	memcpy(rsp + len, get_data + get_off, chunk);
+	len += chunk;
+	get_off += chunk;
+	if (get_off == get_len) {
+		get_active = 0;
+		rsp[0] = 0xa0;
+	} else {
+		rsp[0] = 0x90;
+	}
+	return len;
+}
+
+static void start_get(unsigned char *rsp)
+{
+	static char tmp[4096];
+	struct mock_file *f;
+	uint32_t n;
+	int i, o, sl;
+
+	get_off = 0;
+	get_active = 1;
+	if (strcmp(name, "_Model") == 0) {
+		memset(tmp, 0, 26);
+		strcpy(tmp, "MOCKMODEL");
+		strcpy(tmp + 14, "SUB");
+		strcpy(tmp + 23, "SW");
+		get_data = tmp;
+		get_len = 26;
+	} else if (strcmp(name, "_CryptKey") == 0) {
+		memcpy(tmp, "KEYKEYKEYKEY", 12);
+		get_data = tmp;
+		get_len = 12;
+	} else if (strcmp(name, "_Cap") == 0) {
+		n = htonl(1000000);
+		memcpy(tmp, &n, 4);
+		n = htonl(500000);
+		memcpy(tmp + 4, &n, 4);
+		get_data = tmp;
+		get_len = 8;
+	} else if (strcmp(name, "_List") == 0) {
+		tmp[0] = 0;
+		tmp[1] = nfiles;
+		for (i = 0, o = 2; i < nfiles; i++) {
+			sl = strlen(files[i].name) + 1;
+			tmp[o] = 0;
+			tmp[o + 1] = sl + 3;
+			tmp[o + 2] = 0;
+			memcpy(tmp + o + 3, files[i].name, sl);
+			o += sl + 3;
+		}
+		get_data = tmp;
+		get_len = o;
+	} else if ((f = find_file(name)) != NULL) {
+		get_data = f->data;
+		get_len = f->len;
+	} else {
+		get_active = 0;
+		rsp[0] = 0xc4;
+	}
+}
+
+static void device_write(const unsigned char *pkt, int len, double ready)
+{
+	static unsigned char rsp[0x10000];
+	uint8_t seq = pkt[0], op = pkt[1], hi;
+	int plen = (pkt[2] << 8) | pkt[3];
+	int i = 4, hl, rlen = 3;
+
+	if (plen != len - 1) {
+		fprintf(stderr, "mock: packet length %d in a %d byte write\n", plen, len - 1);
+		mock_errors++;
+	}
+	if (seq_valid && seq != expect_seq) {
+		fprintf(stderr, "mock: sequence %u, expected %u\n", seq, expect_seq);
+		mock_errors++;
+	}
+	seq_valid = 1;
+	expect_seq = seq + 1;
+	/* the answer to a GET, CONNECT or ABORT has to be read before
+	 * anything else goes out */
+	if (gated && in_head != NULL) {
+		fprintf(stderr, "mock: packet %02x sent behind an unread answer\n", op);
+		mock_gate_violations++;
+	}
+	gated = (op == 0x80 || (op & 0x7f) == 0x03 || op == 0xff);
+
+	rsp[0] = 0xa0;
+	if (op == 0x80) {
+		client_mtu = (pkt[6] << 8) | pkt[7];
+		rsp[3] = 0x10;
+		rsp[4] = 0;
+		rsp[5] = MOCK_DEVICE_MTU >> 8;
+		rsp[6] = MOCK_DEVICE_MTU & 0xff;
+		memset(rsp + 7, 0, 3);
+		rlen = 10;
+		i = 11;
+	} else if (op == 0x85) {
+		i = 6;
+	}
+	while (i < len) {
+		hi = pkt[i];
+		if ((hi & 0xc0) == 0xc0) {
+			i += 5;
+			continue;
+		}
+		if ((hi & 0xc0) == 0x80) {
+			i += 2;
+			continue;
+		}
+		hl = (pkt[i + 1] << 8) | pkt[i + 2];
+		if (hl < 3 || i + hl > len) {
+			fprintf(stderr, "mock: bad header %02x length %d\n", hi, hl);
+			mock_errors++;
+			break;
+		}
+		if (hi == 0x01) {
+			int j, n = 0;
+			for (j = i + 4; j < i + hl && pkt[j] && n < 255; j += 2)
+				name[n++] = pkt[j];
+			name[n] = '\0';
+			if ((op & 0x7f) == 0x02)
+				reset_put();
+		} else if (hi == 0x48 || hi == 0x49) {
+			put_body = realloc(put_body, put_len + hl - 3 + 1);
+			memcpy(put_body + put_len, pkt + i + 3, hl - 3);
+			put_len += hl - 3;
+		}
+		i += hl;
+	}
+
+	if (op & 0x80) {
+		if (mock_nlog < MOCK_LOG_SIZE)
+			snprintf(mock_log[mock_nlog++], 40, "%02x %.36s", op, name);
+		if (op != 0xff && mock_refuse[0] && strcmp(name, mock_refuse) == 0) {
+			reset_put();
+			rsp[0] = 0xc3;
+			goto answer;
+		}
+	}
+	switch (op) {
+	case 0x02:
+		rsp[0] = 0x90;
+		break;
+	case 0x82:
+		if (name[0] != '_')
+			mock_put(name, put_body, put_len);
+		reset_put();
+		break;
+	case 0x83:
+		if (!get_active)
+			start_get(rsp);
+		if (get_active)
+			rlen = get_response(rsp);
+		break;
+	case 0xff:
+		mock_aborts++;
+		reset_put();
+		get_active = 0;
+		break;
+	}
+answer:
+	if (op & 0x80)
+		name[0] = '\0';
+	rsp[1] = rlen >> 8;
+	rsp[2] = rlen & 0xff;
+	queue_in(&seq, 1, ready);
+	queue_in(rsp, rlen, ready);
+	if (mock_repeat_answer && mock_writes == mock_repeat_answer) {
+		queue_in(&seq, 1, ready);
+		queue_in(rsp, rlen, ready);
+	}
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct mock_pending *p = calloc(1, sizeof(*p)), **pp;
+	double t = now();
+
+	pthread_mutex_lock(&mock_lock);
+	p->transfer = transfer;
+	if (!(transfer->endpoint & LIBUSB_ENDPOINT_IN)) {
+		mock_writes++;
+		if (++inflight > mock_max_inflight)
+			mock_max_inflight = inflight;
+		if (busy_until < t)
+			busy_until = t;
+		busy_until += mock_latency_us / 1e6;
+		p->ready = busy_until;
+		/* writes queued behind a failed one fail with it */
+		if (mock_fail_write && mock_writes == mock_fail_write)
+			out_halted = mock_fail_status;
+		if (out_halted)
+			p->status = out_halted;
+		else
+			device_write(transfer->buffer, transfer->length,
+				     busy_until + mock_latency_us / 1e6);
+	}
+	for (pp = &pending; *pp; pp = &(*pp)->next);
+	*pp = p;
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct mock_pending *p;
+	int ret = LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&mock_lock);
+	for (p = pending; p; p = p->next) {
+		if (p->transfer == transfer) {
+			p->cancelled = 1;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mock_lock);
+	return ret;
+}
+
+/* Completes the transfer the device finishes first. IN transfers complete
+ * in submission order; if only reads are left and the device has nothing
+ * to say, the first one times out straight away. */
+static int complete_one(void)
+{
+	struct mock_pending **pp, **best = NULL, *p;
+	struct libusb_transfer *t;
+	struct mock_msg *m;
+	double ready, best_ready = 1e18;
+	int in_seen = 0, n;
+
+	for (pp = &pending; *pp; pp = &(*pp)->next) {
+		p = *pp;
+		if (p->cancelled) {
+			ready = 0;
+		} else if (!(p->transfer->endpoint & LIBUSB_ENDPOINT_IN)) {
+			ready = p->ready;
+		} else {
+			if (in_seen)
+				continue;
+			in_seen = 1;
+			ready = in_head ? in_head->ready : 1e16;
+		}
+		if (ready < best_ready) {
+			best_ready = ready;
+			best = pp;
+		}
+	}
+	if (best == NULL)
+		return 0;
+
+	p = *best;
+	*best = p->next;
+	t = p->transfer;
+	if (best_ready > now() && best_ready < 1e16)
+		usleep((best_ready - now()) * 1e6);
+	if (!(t->endpoint & LIBUSB_ENDPOINT_IN))
+		inflight--;
+	if (p->cancelled) {
+		t->status = LIBUSB_TRANSFER_CANCELLED;
+		t->actual_length = 0;
+	} else if (p->status) {
+		t->status = p->status;
+		t->actual_length = 0;
+		/* a stalled endpoint stays halted until it is cleared */
+		if (p->status != LIBUSB_TRANSFER_STALL)
+			out_halted = 0;
+	} else if (!(t->endpoint & LIBUSB_ENDPOINT_IN)) {
+		t->status = LIBUSB_TRANSFER_COMPLETED;
+		t->actual_length = t->length;
+	} else if (in_head == NULL) {
+		t->status = LIBUSB_TRANSFER_TIMED_OUT;
+		t->actual_length = 0;
+	} else {
+		m = in_head;
+		n = m->len < t->length ? m->len : t->length;
+		memcpy(t->buffer, m->data, n);
+		in_head = m->next;
+		if (in_head == NULL)
+			in_tail = NULL;
+		free(m);
+		t->status = LIBUSB_TRANSFER_COMPLETED;
+		t->actual_length = n;
+	}
+	free(p);
+	t->callback(t);
+	return 1;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+		struct timeval *tv, int *completed)
+{
+	if (completed && *completed)
+		return 0;
+	pthread_mutex_lock(&mock_lock);
+	complete_one();
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed)
+{
+	return libusb_handle_events_timeout_completed(ctx, NULL, completed);
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+	return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	free(transfer);
+}
+
+int libusb_init(libusb_context **ctx)
+{
+	if (ctx)
+		*ctx = calloc(1, sizeof(libusb_context));
+	return 0;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+	free(ctx);
+}
+
+int libusb_has_capability(uint32_t capability)
+{
+	return 1;
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	*list = calloc(2, sizeof(libusb_device *));
+	(*list)[0] = &mock_dev;
+	return 1;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	free(list);
+}
+
+libusb_device *libusb_ref_device(libusb_device *dev)
+{
+	return dev;
+}
+
+void libusb_unref_device(libusb_device *dev)
+{
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+	return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+	return 5;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int len)
+{
+	port_numbers[0] = 1;
+	return 1;
+}
+
+int libusb_get_device_descriptor(libusb_device *dev,
+		struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->idVendor = 0x07cf;
+	desc->idProduct = 0x6101;
+	desc->iManufacturer = 1;
+	desc->iProduct = 2;
+	desc->iSerialNumber = 3;
+	return 0;
+}
+
+static const struct libusb_endpoint_descriptor endpoints[2] = {
+	{ 7, 5, 0x81, 2, 512 },
+	{ 7, 5, 0x02, 2, 512 },
+};
+static const struct libusb_interface_descriptor altsetting = { 0, 0, 2, endpoints };
+static const struct libusb_interface interface = { &altsetting, 1 };
+static struct libusb_config_descriptor config = { 1, &interface };
+
+int libusb_get_active_config_descriptor(libusb_device *dev,
+		struct libusb_config_descriptor **cfg)
+{
+	*cfg = &config;
+	return 0;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *cfg)
+{
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle)
+{
+	*handle = calloc(1, sizeof(libusb_device_handle));
+	(*handle)->dev = dev;
+	return 0;
+}
+
+void libusb_close(libusb_device_handle *handle)
+{
+	free(handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *handle)
+{
+	return handle->dev;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *handle,
+		uint8_t desc_index, unsigned char *data, int length)
+{
+	const char *s = desc_index == 1 ? "CASIO" :
+			desc_index == 2 ? "EX-word" : "MOCK0001";
+	snprintf((char *)data, length, "%s", s);
+	return strlen((char *)data);
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int interface_number)
+{
+	return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *handle, int interface_number)
+{
+	return 0;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *handle,
+		int interface_number, int alternate_setting)
+{
+	return 0;
+}
+
+int libusb_clear_halt(libusb_device_handle *handle, unsigned char endpoint)
+{
+	mock_clear_halts++;
+	if (!(endpoint & LIBUSB_ENDPOINT_IN))
+		out_halted = 0;
+	return 0;
+}
+
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	return 0;
+}
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx)
+{
+	return calloc(1, sizeof(struct libusb_pollfd *));
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+	free(pollfds);
+}
+
+void libusb_set_pollfd_notifiers(libusb_context *ctx,
+		libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+		void *user_data)
+{
+}
+
+int libusb_hotplug_register_callback(libusb_context *ctx,
+		libusb_hotplug_event events, libusb_hotplug_flag flags,
+		int vendor_id, int product_id, int dev_class,
+		libusb_hotplug_callback_fn cb_fn, void *user_data,
+		libusb_hotplug_callback_handle *handle)
+{
+	if (flags & LIBUSB_HOTPLUG_ENUMERATE)
+		cb_fn(ctx, &mock_dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+	if (handle)
+		*handle = 1;
+	return 0;
+}
+
+void libusb_hotplug_deregister_callback(libusb_context *ctx,
+		libusb_hotplug_callback_handle handle)
+{
+}
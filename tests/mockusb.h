@@ -0,0 +1,56 @@
+/* libexword - library for transffering files to Casio-EX-Word dictionaries
+ *
+ * Copyright (C) 2010 - Brian Johnson <brijohn@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *
+ */
+
+#ifndef MOCKUSB_H
+#define MOCKUSB_H
+
+#include <stdio.h>
+
+#define MOCK_LOG_SIZE 256
+
+/* device behaviour */
+extern int mock_latency_us;
+extern char mock_refuse[32];
+extern int mock_fail_write;		/* OUT transfer, counted like mock_writes, */
+extern int mock_fail_status;		/* that fails with this status */
+extern int mock_repeat_answer;		/* OUT transfer answered twice */
+
+/* what the host did */
+extern int mock_writes;
+extern int mock_max_inflight;
+extern int mock_aborts;
+extern int mock_errors;
+extern int mock_gate_violations;
+extern int mock_clear_halts;
+extern char mock_log[MOCK_LOG_SIZE][40];
+extern int mock_nlog;
+
+int mock_put(const char *name, const char *data, int len);
+int mock_get(const char *name, const char **data, int *len);
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+#endif
@@ -0,0 +1,235 @@
+/* libexword - library for transffering files to Casio-EX-Word dictionaries
+ *
+ * Copyright (C) 2010 - Brian Johnson <brijohn@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *
+ */
+
+/* Checks that commands reach the device in the order they were issued,
+ * that batches pipeline their PUTs, and that nothing is sent while the
+ * answer to a GET, CONNECT or ABORT is still outstanding. Also checks
+ * that an upload survives a write that never reaches the device and an
+ * answer the device sends twice. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+#include "exword.h"
+#include "mockusb.h"
+
+static int failures;
+static exword_t *dev;
+static uint32_t cancel_at;
+
+static int log_matches(int from, const char **want, int n)
+{
+	int i;
+	if (mock_nlog - from != n) {
+		fprintf(stderr, "%d packets logged, expected %d\n", mock_nlog - from, n);
+		for (i = from; i < mock_nlog; i++)
+			fprintf(stderr, "  %s\n", mock_log[i]);
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (strcmp(mock_log[from + i], want[i]) != 0) {
+			fprintf(stderr, "packet %d is '%s', expected '%s'\n",
+				i, mock_log[from + i], want[i]);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void progress(char *filename, uint32_t transferred, uint32_t length, void *user)
+{
+	if (cancel_at && transferred >= cancel_at)
+		exword_cancel(dev);
+}
+
+static void test_batch(void)
+{
+	const char *lock[] = { "82 _Unlock", "82 _CName", "83 _CryptKey" };
+	const char *query[] = { "85 ", "83 _List", "83 _Model", "83 _Cap", "82 _Lock" };
+	exword_batch_t *b;
+	exword_cryptkey_t key;
+	exword_model_t model;
+	exword_capacity_t cap;
+	exword_dirent_t *entries;
+	uint16_t count;
+	int start;
+
+	memset(&key, 0, sizeof(key));
+	mock_max_inflight = 0;
+	start = mock_nlog;
+	b = exword_batch_new(dev);
+	CHECK(exword_batch_unlock(b) == 0);
+	CHECK(exword_batch_cname(b, "name", "id") == 1);
+	CHECK(exword_batch_cryptkey(b, &key) == 2);
+	CHECK(exword_batch_run(b) == 0x20);
+	CHECK(memcmp(key.key, "KEYKEYKEYKEY", 12) == 0);
+	CHECK(exword_batch_response(b, 1) == 0x20);
+	CHECK(exword_batch_response(b, 3) == -1);
+	CHECK(exword_batch_run(b) == -1);
+	exword_batch_free(b);
+	CHECK(log_matches(start, lock, 3));
+
+	/* each GET waits for the answer to the one before it */
+	start = mock_nlog;
+	b = exword_batch_new(dev);
+	exword_batch_setpath(b, (uint8_t *) ROOT, 0);
+	exword_batch_list(b, &entries, &count);
+	exword_batch_get_model(b, &model);
+	exword_batch_get_capacity(b, &cap);
+	exword_batch_lock(b);
+	CHECK(exword_batch_run(b) == 0x20);
+	CHECK(strcmp(model.model, "MOCKMODEL") == 0);
+	CHECK(cap.total == 1000000 && cap.free == 500000);
+	CHECK(log_matches(start, query, 5));
+	exword_free_list(entries);
+	exword_batch_free(b);
+
+	/* a refused command does not stop the rest of the batch */
+	strcpy(mock_refuse, "_CName");
+	start = mock_nlog;
+	b = exword_batch_new(dev);
+	exword_batch_unlock(b);
+	exword_batch_cname(b, "name", "id");
+	exword_batch_cryptkey(b, &key);
+	CHECK(exword_batch_run(b) == 0x43);
+	CHECK(exword_batch_response(b, 0) == 0x20);
+	CHECK(exword_batch_response(b, 1) == 0x43);
+	CHECK(exword_batch_response(b, 2) == 0x20);
+	CHECK(log_matches(start, lock, 3));
+	exword_batch_free(b);
+	mock_refuse[0] = '\0';
+
+	/* a batch that is never run sends nothing */
+	start = mock_nlog;
+	b = exword_batch_new(dev);
+	exword_batch_unlock(b);
+	exword_batch_free(b);
+	CHECK(mock_nlog == start);
+}
+
+static void test_async(char *data, int len)
+{
+	const char *want[] = { "82 a.bin", "82 _Unlock", "82 _Lock" };
+	exword_async_t *h;
+	exword_batch_t *b;
+	int start = mock_nlog;
+
+	h = exword_send_file_async(dev, "a.bin", data, len, NULL, NULL);
+	CHECK(h != NULL);
+	b = exword_batch_new(dev);
+	exword_batch_unlock(b);
+	exword_batch_lock(b);
+	CHECK(exword_batch_run(b) == 0x20);
+	CHECK(exword_async_done(h));
+	CHECK(exword_async_wait(h) == 0x20);
+	CHECK(log_matches(start, want, 3));
+	exword_batch_free(b);
+	exword_async_free(h);
+}
+
+static void test_abort(char *data, int len)
+{
+	const char *stored;
+	char *out;
+	int size, start, writes;
+
+	start = mock_nlog;
+	cancel_at = len / 4;
+	CHECK(exword_send_file(dev, "c.bin", data, len) == LIBUSB_ERROR_INTERRUPTED);
+	cancel_at = 0;
+	CHECK(mock_nlog - start == 1 && strcmp(mock_log[start], "ff c.bin") == 0);
+	CHECK(mock_get("c.bin", &stored, &size) != 0);
+
+	/* a cancel between commands stops the next one before it sends */
+	writes = mock_writes;
+	exword_cancel(dev);
+	CHECK(exword_send_file(dev, "b.bin", data, len) == LIBUSB_ERROR_INTERRUPTED);
+	CHECK(mock_writes == writes);
+
+	CHECK(exword_send_file(dev, "b.bin", data, len) == 0x20);
+	CHECK(mock_get("b.bin", &stored, &size) == 0);
+	CHECK(size == len && memcmp(stored, data, len) == 0);
+
+	cancel_at = len / 4;
+	CHECK(exword_get_file(dev, "b.bin", &out, &size) == LIBUSB_ERROR_INTERRUPTED);
+	cancel_at = 0;
+	CHECK(exword_get_file(dev, "b.bin", &out, &size) == 0x20);
+	CHECK(size == len && memcmp(out, data, len) == 0);
+	free(out);
+}
+
+static void test_faults(char *data, int len)
+{
+	char *names[] = { "s.bin", "t.bin" };
+	int status[] = { LIBUSB_TRANSFER_STALL, LIBUSB_TRANSFER_TIMED_OUT };
+	const char *stored;
+	int i, size, halts;
+
+	for (i = 0; i < 2; i++) {
+		halts = mock_clear_halts;
+		mock_fail_status = status[i];
+		mock_fail_write = mock_writes + 3;
+		CHECK(exword_send_file(dev, names[i], data, len) == 0x20);
+		mock_fail_write = 0;
+		CHECK(mock_clear_halts - halts == (status[i] == LIBUSB_TRANSFER_STALL));
+		CHECK(mock_get(names[i], &stored, &size) == 0);
+		CHECK(size == len && memcmp(stored, data, len) == 0);
+	}
+
+	mock_repeat_answer = mock_writes + 3;
+	CHECK(exword_send_file(dev, "r.bin", data, len) == 0x20);
+	mock_repeat_answer = 0;
+	CHECK(mock_get("r.bin", &stored, &size) == 0);
+	CHECK(size == len && memcmp(stored, data, len) == 0);
+}
+
+int main(void)
+{
+	int len = 100000, depth, i;
+	char *data = malloc(len);
+
+	for (i = 0; i < len; i++)
+		data[i] = rand();
+	dev = exword_open();
+	CHECK(dev != NULL);
+	if (dev == NULL)
+		return 1;
+	exword_register_callbacks(dev, progress, progress, NULL);
+	CHECK(exword_connect(dev) == 0x20);
+	for (depth = 1; depth <= 4; depth += 3) {
+		exword_set_queue_depth(dev, depth);
+		exword_set_read_ahead(dev, depth > 1);
+		test_batch();
+		if (depth > 1)
+			CHECK(mock_max_inflight == 3);
+		test_async(data, len);
+		test_abort(data, len);
+		test_faults(data, len);
+	}
+	exword_disconnect(dev);
+	exword_close(dev);
+	free(data);
+
+	CHECK(mock_aborts == 4);
+	CHECK(mock_errors == 0);
+	CHECK(mock_gate_violations == 0);
+	return failures ? 1 : 0;
+}